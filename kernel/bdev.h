@@ -0,0 +1,32 @@
+// Block devices.
+//
+// bio.c does all disk I/O through bdev[dev], so a device number
+// names a block device the way a major number names a character
+// device in devsw[]. A driver can run several devices; unit says
+// which one.
+
+struct bdevsw {
+  // start reading or writing b->data at block blockno, which
+  // need not be b->blockno (e.g. for a stripe's member disk).
+  // the driver sets b->disk while the request is in flight.
+  void (*start)(int unit, struct buf *b, uint blockno, int write);
+  // wait for the request started on b at blockno to finish.
+  void (*wait)(int unit, struct buf *b, uint blockno);
+  // write n blocks from data, contiguous in memory, to
+  // blockno.. and wait for them. class is for iostat.
+  void (*writen)(int unit, uint blockno, void *data, uint n, int class);
+  // make every write that has finished durable.
+  void (*flush)(int unit);
+  // tell the device blocks blockno..blockno+nblocks-1 are unused.
+  // their contents are undefined afterwards.
+  void (*discard)(int unit, uint blockno, uint nblocks);
+  // device size, in blocks.
+  uint (*size)(int unit);
+};
+
+struct bdev {
+  struct bdevsw *sw;  // 0 if no device
+  int unit;
+};
+
+extern struct bdev bdev[];
@@ -6,8 +6,13 @@
 // a synchronization point for disk blocks used by multiple processes.
 //
 // Interface:
-// * To get a buffer for a particular disk block, call bread.
+// * To get a buffer for a particular disk block, call bread,
+//     or breadclass if it holds file data or belongs to the log.
 // * After changing buffer data, call bwrite to write it to disk.
+// * To overlap several writes, call bawrite on each buffer, then
+//     bwait on each before releasing it; bflush then makes the
+//     finished writes durable.
+// * bwriten writes a run of blocks from memory, bypassing the cache.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -22,10 +27,16 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "bdev.h"
+#include "iostat.h"
+
+struct bdev bdev[NBDEV];
 
 struct {
   struct spinlock lock;
   struct buf buf[NBUF];
+  // page-aligned, so that a block can be mapped as a page.
+  uchar data[NBUF][BSIZE] __attribute__((aligned(PGSIZE)));
 
   // Linked list of all buffers, through prev/next.
   // Sorted by how recently the buffer was used.
@@ -44,6 +55,7 @@ binit(void)
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
+    b->data = bcache.data[b - bcache.buf];
     b->next = bcache.head.next;
     b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
@@ -52,6 +64,40 @@ binit(void)
   }
 }
 
+// Give the next free device number, starting at ROOTDEV,
+// to unit of a block device driver.
+int
+bdevattach(struct bdevsw *sw, int unit)
+{
+  int dev;
+
+  for(dev = ROOTDEV; dev < NBDEV; dev++){
+    if(bdev[dev].sw == 0){
+      bdev[dev].sw = sw;
+      bdev[dev].unit = unit;
+      return dev;
+    }
+  }
+  panic("bdevattach");
+}
+
+static struct bdev*
+getbdev(uint dev)
+{
+  if(dev >= NBDEV || bdev[dev].sw == 0)
+    panic("no block device");
+  return &bdev[dev];
+}
+
+// Size of block device dev, in blocks.
+uint
+bdevsize(uint dev)
+{
+  struct bdev *bd = getbdev(dev);
+
+  return bd->sw->size(bd->unit);
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
@@ -79,6 +125,7 @@ bget(uint dev, uint blockno)
       b->dev = dev;
       b->blockno = blockno;
       b->valid = 0;
+      b->class = IO_META;
       b->refcnt = 1;
       release(&bcache.lock);
       acquiresleep(&b->lock);
@@ -88,17 +135,40 @@ bget(uint dev, uint blockno)
   panic("bget: no buffers");
 }
 
+// Read b from disk if the cache doesn't hold it yet.
+static void
+bfill(struct buf *b)
+{
+  if(!b->valid) {
+    struct bdev *bd = getbdev(b->dev);
+    bd->sw->start(bd->unit, b, b->blockno, 0);
+    bd->sw->wait(bd->unit, b, b->blockno);
+    b->valid = 1;
+  }
+}
+
 // Return a locked buf with the contents of the indicated block.
+// A block new to the cache counts as metadata, until
+// breadclass says otherwise.
 struct buf*
 bread(uint dev, uint blockno)
 {
   struct buf *b;
 
   b = bget(dev, blockno);
-  if(!b->valid) {
-    virtio_disk_rw(b, 0);
-    b->valid = 1;
-  }
+  bfill(b);
+  return b;
+}
+
+// Like bread, for a block of the given class (see iostat.h).
+struct buf*
+breadclass(uint dev, uint blockno, int class)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->class = class;
+  bfill(b);
   return b;
 }
 
@@ -106,9 +176,65 @@ bread(uint dev, uint blockno)
 void
 bwrite(struct buf *b)
 {
+  bawrite(b);
+  bwait(b);
+}
+
+// Start writing b's contents to disk, without waiting.
+// b must stay locked until bwait(b).
+void
+bawrite(struct buf *b)
+{
+  struct bdev *bd = getbdev(b->dev);
+
+  if(!holdingsleep(&b->lock))
+    panic("bawrite");
+  bd->sw->start(bd->unit, b, b->blockno, 1);
+}
+
+// Wait for the write started by bawrite(b) to finish.
+void
+bwait(struct buf *b)
+{
+  struct bdev *bd = getbdev(b->dev);
+
   if(!holdingsleep(&b->lock))
-    panic("bwrite");
-  virtio_disk_rw(b, 1);
+    panic("bwait");
+  bd->sw->wait(bd->unit, b, b->blockno);
+}
+
+// Make every write to dev that has finished durable.
+// Writes that finish before the call can't be reordered
+// after any write started after it returns.
+void
+bflush(uint dev)
+{
+  struct bdev *bd = getbdev(dev);
+
+  bd->sw->flush(bd->unit);
+}
+
+// Write the n blocks at data, which needn't be in the cache,
+// to blockno..blockno+n-1 on dev in one request, and wait
+// for it. Cached copies of those blocks are not updated, so
+// the caller must not bread them afterwards.
+void
+bwriten(uint dev, uint blockno, void *data, uint n, int class)
+{
+  struct bdev *bd = getbdev(dev);
+
+  bd->sw->writen(bd->unit, blockno, data, n, class);
+}
+
+// Tell dev that blocks blockno..blockno+n-1 are free, so it can
+// release their storage. None of them may be in use, so none
+// of them can be waiting in the cache to be written.
+void
+bdiscard(uint dev, uint blockno, uint n)
+{
+  struct bdev *bd = getbdev(dev);
+
+  bd->sw->discard(bd->unit, blockno, n);
 }
 
 // Release a locked buffer.
@@ -3,10 +3,11 @@ struct buf {
   int disk;    // does disk "own" buf?
   uint dev;
   uint blockno;
+  int class;   // IO_META, IO_DATA or IO_LOG, for iostat
   struct sleeplock lock;
   uint refcnt;
   struct buf *prev; // LRU cache list
   struct buf *next;
-  uchar data[BSIZE];
+  uchar *data; // BSIZE bytes, kept apart so that a run of blocks can be contiguous
 };
 
@@ -1,4 +1,5 @@
 struct buf;
+struct bdevsw;
 struct context;
 struct file;
 struct inode;
@@ -8,12 +9,23 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct diskstat;
+struct fsstat;
+struct disklabel;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     breadclass(uint, uint, int);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bawrite(struct buf*);
+void            bwait(struct buf*);
+void            bflush(uint);
+void            bdiscard(uint, uint, uint);
+void            bwriten(uint, uint, void*, uint, int);
+int             bdevattach(struct bdevsw*, int);
+uint            bdevsize(uint);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
@@ -33,12 +45,15 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             fileallocate(struct file*, uint);
 
 // fs.c
+extern uint     nbitmap;
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
+void            dirforget(struct inode*, char*);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(uint, short);
+struct inode*   ialloc(uint, short, uint);
 struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
@@ -53,11 +68,14 @@ int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+int             ireserve(struct inode*, uint);
+void            itrim(struct inode*);
+void            iplace(struct inode*, struct inode*);
+void            fsstat(struct inode*, struct fsstat*);
 
 // ramdisk.c
 void            ramdiskinit(void);
-void            ramdiskintr(void);
-void            ramdiskrw(struct buf*);
+uint64          ramdisksize(void);
 
 // kalloc.c
 void*           kalloc(void);
@@ -67,7 +85,14 @@ void            kinit(void);
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
-void            begin_op(void);
+void            log_discard(uint);
+void            log_undiscard(uint);
+int             log_inuse(uint);
+int             log_seq(void);
+void            log_force(int);
+int             log_mode(int);
+void            log_ordered(void);
+void            begin_op(int);
 void            end_op(void);
 
 // pipe.c
@@ -100,6 +125,7 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kthread(void (*)(void), char*);
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -107,6 +133,10 @@ int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 
+// stripe.c
+void            stripeadd(struct bdevsw*, int, struct disklabel*);
+void            stripeattach(void);
+
 // swtch.S
 void            swtch(struct context*, struct context*);
 
@@ -182,8 +212,8 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
-void            virtio_disk_intr(void);
+void            virtio_disk_intr(int);
+int             virtio_disk_stat(int, struct diskstat*);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -0,0 +1,21 @@
+// Disk driver completion modes and counters, summed over
+// all virtio disks, shared between the kernel and the
+// diskstat() system call.
+
+#define DISK_MODE_INTR  0  // sleep until the completion interrupt
+#define DISK_MODE_POLL  1  // spin on the used ring briefly, then sleep
+
+struct diskstat {
+  int ndisk;         // virtio disks found
+  int mode;          // DISK_MODE_INTR or DISK_MODE_POLL
+  int event_idx;     // was VIRTIO_RING_F_EVENT_IDX negotiated?
+  int flush;         // was VIRTIO_BLK_F_FLUSH negotiated?
+  int discard;       // was VIRTIO_BLK_F_DISCARD negotiated?
+  uint64 nreq;       // requests submitted
+  uint64 nnotify;    // queue notifications actually written
+  uint64 nflush;     // cache flushes
+  uint64 ndiscard;   // discard requests
+  uint64 nintr;      // completion interrupts taken
+  uint64 npollhit;   // requests that completed while polling
+  uint64 npollmiss;  // polls that gave up and went to sleep
+};
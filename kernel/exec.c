@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fs.h"
 #include "elf.h"
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
@@ -31,7 +32,9 @@ exec(char *path, char **argv)
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
-  begin_op();
+  // namei() may free a directory removed meanwhile, and the
+  // last iput() the program, if it has been unlinked.
+  begin_op(2*IPUTOPBLOCKS);
 
   if((ip = namei(path)) == 0){
     end_op();
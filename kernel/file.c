@@ -71,12 +71,19 @@ fileclose(struct file *f)
   ff = *f;
   f->ref = 0;
   f->type = FD_NONE;
+  f->reserved = 0;
   release(&ftable.lock);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op();
+    begin_op(ff.reserved ? TRIMOPBLOCKS+IPUTOPBLOCKS : IPUTOPBLOCKS);
+    if(ff.reserved){
+      // give back blocks fallocate() reserved that weren't written.
+      ilock(ff.ip);
+      itrim(ff.ip);
+      iunlock(ff.ip);
+    }
     iput(ff.ip);
     end_op();
   }
@@ -129,6 +136,19 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
+// The most blocks one write op may allocate: WRITEOPMAX,
+// or fewer if their bitmap blocks wouldn't fit in the op's
+// log space.
+static int
+writeopmax(void)
+{
+  int nb = WRITEOPMAX;
+
+  while(WRITEOPBLOCKS(nb) > MAXOPBLOCKS)
+    nb--;
+  return nb;
+}
+
 // Write to file f.
 // addr is a user virtual address.
 int
@@ -146,20 +166,22 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // data blocks go straight home, so a write op only
+    // logs the i-node, extent (or indirect) blocks and
+    // allocation blocks, with a block of slop for non-aligned
+    // writes. write at most writeopmax() blocks at a time,
+    // so that a big write doesn't keep its transaction from
+    // committing for long.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = (writeopmax()-1) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_op(WRITEOPBLOCKS((n1 + BSIZE - 1) / BSIZE + 1));
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -180,3 +202,34 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Reserve disk blocks for file f's contents up to byte len,
+// so that writes up to there find them already allocated,
+// contiguous as far as possible. They're given back when f is
+// closed if they haven't been written by then.
+int
+fileallocate(struct file *f, uint len)
+{
+  uint off, max;
+  int r;
+
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+
+  ilock(f->ip);
+  off = f->ip->size;
+  r = f->ip->type == T_FILE ? 0 : -1;
+  iunlock(f->ip);
+
+  // a few blocks per op, as in filewrite().
+  max = writeopmax() * BSIZE;
+  while(r == 0 && off < len){
+    off = len - off > max ? off + max : len;
+    begin_op(WRITEOPBLOCKS(writeopmax()));
+    ilock(f->ip);
+    f->reserved = 1;
+    r = ireserve(f->ip, off);
+    iunlock(f->ip);
+    end_op();
+  }
+  return r;
+}
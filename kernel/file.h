@@ -3,6 +3,7 @@ struct file {
   int ref; // reference count
   char readable;
   char writable;
+  char reserved;     // FD_INODE: fallocate() reserved blocks
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
@@ -18,15 +19,28 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext; // itable hash chain
+  struct inode *prev; // LRU list, while ref is 0
+  struct inode *next;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  int logseq;         // last transaction to change it (see fsync)
+  int dataseq;        // last one to change its contents or size
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint flags;
+  union {
+    uint addrs[NDIRECT+NINDLEVEL];  // or the root of its extent tree
+    char data[NINLINE];             // or its contents (DI_INLINE)
+  };
+  uint efbn;          // extent last looked up (FS_EXTENTS):
+  uint estart;        //   file block efbn is at disk block estart,
+  uint elen;          //   and so on for elen blocks
+  uint bgoal;         // where to allocate its next block, or 0
 };
 
 // map major device number to device functions.
@@ -38,3 +52,4 @@ struct devsw {
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define IOSTAT  2
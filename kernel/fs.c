@@ -20,11 +20,20 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "iostat.h"
+#include "fsstat.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
+uint nbitmap;  // bitmap blocks in sb's file system
+
+static void bsuminit(int);
+static void imapinit(int);
+static void dcinit(void);
+static void dcpurge(uint, uint);
+static void dcstat(struct fsstat*);
 
 // Read the super block.
 static void
@@ -43,7 +52,69 @@ fsinit(int dev) {
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  if(sb.bsize != BSIZE)
+    panic("file system block size isn't BSIZE");
+  if(sb.size > bdevsize(dev))
+    panic("file system larger than disk");
+  nbitmap = NBITMAP(sb);
+  if(nbitmap > MAXBITMAP)
+    panic("file system too big for MAXOPBLOCKS");
   initlog(dev, &sb);
+  bsuminit(dev);
+  imapinit(dev);
+  dcinit();
+}
+
+// Blocks.
+//
+// The blocks are divided into allocation groups of BGROUP
+// blocks. bsum keeps a count of each group's free blocks, so
+// that balloc() only reads the bitmap of groups that have
+// some, and the block after the last one allocated, the next-
+// fit cursor used when the caller has no goal of its own.
+// The counts include blocks freed but not yet reusable (see
+// log_inuse()), so they are only a hint.
+
+#define BGROUP 1024  // blocks per allocation group; divides BPB
+#define NBGROUP (MAXBITMAP * BPB / BGROUP)
+
+struct {
+  struct spinlock lock;
+  uint ngroup;
+  uint nfree[NBGROUP];
+  uint next;
+  struct fsstat st;
+} bsum;
+
+// Count the free blocks in each group.
+static void
+bsuminit(int dev)
+{
+  struct buf *bp;
+  uint b, m;
+
+  initlock(&bsum.lock, "bsum");
+  bsum.ngroup = (sb.size + BGROUP - 1) / BGROUP;
+  bp = 0;
+  for(b = 0; b < sb.size; b++){
+    if(b % BPB == 0){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, BBLOCK(b, sb));
+    }
+    // a byte at a time where it's all in use or all free.
+    m = bp->data[(b % BPB)/8];
+    if(b % 8 == 0 && b + 8 <= sb.size && (m == 0xff || m == 0)){
+      if(m == 0)
+        bsum.nfree[b / BGROUP] += 8;
+      b += 7;
+      continue;
+    }
+    if((m & (1 << (b % 8))) == 0)
+      bsum.nfree[b / BGROUP]++;
+  }
+  if(bp)
+    brelse(bp);
 }
 
 // Zero a block.
@@ -58,50 +129,207 @@ bzero(int dev, int bno)
   brelse(bp);
 }
 
-// Blocks.
+// Mark block b in use, if it's free, in bp, its bitmap block.
+static int
+bgrab(struct buf *bp, uint b)
+{
+  int bi = b % BPB;
+  int m = 1 << (bi % 8);
 
-// Allocate a zeroed disk block.
-// returns 0 if out of disk space.
+  if((bp->data[bi/8] & m) != 0 || log_inuse(b))  // Is block free?
+    return 0;
+  bp->data[bi/8] |= m;  // Mark block in use.
+  log_write(bp);
+  acquire(&bsum.lock);
+  bsum.nfree[b / BGROUP]--;
+  release(&bsum.lock);
+  return 1;
+}
+
+// Look for a free block in from..to-1, which are all in one
+// group, and take it and up to *n-1 free blocks after it.
+// returns the first, or 0, and the number taken in *n.
+static uint
+bscan(uint dev, uint from, uint to, uint *n)
+{
+  struct buf *bp;
+  uint b, m;
+
+  bp = bread(dev, BBLOCK(from, sb));
+  for(b = from; b < to; b++){
+    // skip bytes of blocks in use.
+    if(b % 8 == 0 && bp->data[(b % BPB)/8] == 0xff){
+      b += 7;
+      continue;
+    }
+    if(bgrab(bp, b)){
+      for(m = 1; m < *n && b + m < to && bgrab(bp, b + m); m++)
+        ;
+      *n = m;
+      brelse(bp);
+      return b;
+    }
+  }
+  brelse(bp);
+  return 0;
+}
+
+// Allocate up to *n contiguous disk blocks, from block goal if
+// it's free, or else as near after it as possible, or after
+// the last blocks allocated if goal is 0. The blocks are
+// zeroed unless they're to hold a regular file's data:
+// writei() writes those home without the log, and bytes it
+// doesn't write are past the end of the file.
+// returns the first block, and the number in *n, or 0 if out
+// of disk space.
 static uint
-balloc(uint dev)
+ballocn(uint dev, int data, uint goal, uint *n)
+{
+  uint b, g, i, ng, from, to;
+  uint64 t0 = r_time();
+
+  acquire(&bsum.lock);
+  if(goal == 0 || goal >= sb.size)
+    goal = bsum.next < sb.size ? bsum.next : 0;
+  release(&bsum.lock);
+
+  // goal's group from goal on, the other groups that have
+  // free blocks, round robin, then the start of goal's group.
+  ng = bsum.ngroup;
+  b = 0;
+  for(i = 0; i <= ng && b == 0; i++){
+    g = (goal / BGROUP + i) % ng;
+    if(bsum.nfree[g] == 0)
+      continue;
+    from = i == 0 ? goal : g * BGROUP;
+    to = i == ng ? goal : min((g + 1) * BGROUP, sb.size);
+    acquire(&bsum.lock);
+    bsum.st.nscan++;
+    release(&bsum.lock);
+    b = bscan(dev, from, to, n);
+  }
+
+  acquire(&bsum.lock);
+  bsum.st.nalloc++;
+  if(b == 0){
+    release(&bsum.lock);
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  bsum.st.nblock += *n;
+  if(b == goal)
+    bsum.st.ngoal++;
+  bsum.next = b + *n;
+  release(&bsum.lock);
+
+  for(i = 0; i < *n; i++){
+    log_undiscard(b + i);
+    if(!data)
+      bzero(dev, b + i);
+  }
+
+  acquire(&bsum.lock);
+  bsum.st.ticks += r_time() - t0;
+  release(&bsum.lock);
+  return b;
+}
+
+// Allocate a disk block, as ballocn().
+static uint
+balloc(uint dev, int data, uint goal)
+{
+  uint n = 1;
+
+  return ballocn(dev, data, goal, &n);
+}
+
+// Free disk blocks b..b+n-1, with one bread() per bitmap block.
+static void
+bfree(int dev, uint b, uint n)
 {
-  int b, bi, m;
   struct buf *bp;
+  int bi, m;
 
   bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
+  for(; n > 0; b++, n--){
+    if(bp == 0 || bp->blockno != BBLOCK(b, sb)){
+      if(bp){
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
       }
+      bp = bread(dev, BBLOCK(b, sb));
     }
+    bi = b % BPB;
+    m = 1 << (bi % 8);
+    if((bp->data[bi/8] & m) == 0)
+      panic("freeing free block");
+    bp->data[bi/8] &= ~m;
+    log_discard(b);
+    acquire(&bsum.lock);
+    bsum.nfree[b / BGROUP]++;
+    release(&bsum.lock);
+  }
+  if(bp){
+    log_write(bp);
     brelse(bp);
   }
-  printf("balloc: out of blocks\n");
-  return 0;
 }
 
-// Free a disk block.
-static void
-bfree(int dev, uint b)
+static uint bmap(struct inode*, uint, uint*);
+
+// Choose where new inode ip, being created in directory dp,
+// should get its blocks: a directory in the group with the
+// most free blocks, to spread directories out, and anything
+// else just after dp's first block, to keep a directory's
+// files together.
+// Caller must hold both locks.
+void
+iplace(struct inode *ip, struct inode *dp)
 {
-  struct buf *bp;
-  int bi, m;
+  uint g, best, run;
+
+  if(ip->type == T_DIR){
+    acquire(&bsum.lock);
+    best = 0;
+    for(g = 1; g < bsum.ngroup; g++)
+      if(bsum.nfree[g] > bsum.nfree[best])
+        best = g;
+    release(&bsum.lock);
+    ip->bgoal = best * BGROUP;
+  } else if(dp->size > 0 && (dp->flags & DI_INLINE) == 0){
+    ip->bgoal = bmap(dp, 0, &run);
+  }
+}
 
-  bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
-  m = 1 << (bi % 8);
-  if((bp->data[bi/8] & m) == 0)
-    panic("freeing free block");
-  bp->data[bi/8] &= ~m;
-  log_write(bp);
-  brelse(bp);
+// Report the allocator's counters and the free space, and,
+// if ip isn't 0, how fragmented ip is.
+// Caller must hold ip->lock.
+void
+fsstat(struct inode *ip, struct fsstat *st)
+{
+  uint bn, addr, end, run, g;
+
+  acquire(&bsum.lock);
+  *st = bsum.st;
+  st->nblocks = sb.size;
+  st->ngroup = bsum.ngroup;
+  st->nfree = 0;
+  for(g = 0; g < st->ngroup; g++)
+    st->nfree += bsum.nfree[g];
+  release(&bsum.lock);
+
+  dcstat(st);
+
+  st->nrun = 0;
+  if(ip == 0 || ip->type == T_DEVICE || (ip->flags & DI_INLINE))
+    return;
+  // the file has no holes, so bmap() won't allocate.
+  end = 0;
+  for(bn = 0; bn < (ip->size + BSIZE - 1) / BSIZE; bn += run){
+    if((addr = bmap(ip, bn, &run)) != end)
+      st->nrun++;
+    end = addr + run;
+  }
 }
 
 // Inodes.
@@ -109,7 +337,8 @@ bfree(int dev, uint b)
 // An inode describes a single unnamed file.
 // The inode disk structure holds metadata: the file's type,
 // its size, the number of links referring to it, and the
-// list of blocks holding the file's content.
+// list of blocks holding the file's content, or the content
+// itself if it's small (DI_INLINE).
 //
 // The inodes are laid out sequentially on disk at block
 // sb.inodestart. Each inode has a number, indicating its
@@ -129,18 +358,20 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref.
+//   An entry whose ref is zero stays in the table, on an
+//   LRU list, so that another iget() can use it without
+//   reading the inode again, until iget() needs it for a
+//   different inode.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
-//   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ilock() reads the inode from the disk and sets
+//   ip->valid, while iput() clears ip->valid if it frees
+//   the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -164,58 +395,145 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is hashed on (dev, inum). Each hash bucket's
+// spin-lock protects the ip->ref, ip->dev, ip->inum and
+// ip->hnext of the entries in it, and one must hold it while
+// using any of those fields. itable.lock protects the LRU
+// list of unreferenced entries, and is acquired after a
+// bucket lock, never before one.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 31
+
 struct {
   struct spinlock lock;
   struct inode inode[NINODE];
+
+  // Entries whose ref is zero, through prev/next.
+  // lru.next is the most recently used, lru.prev the least.
+  struct inode lru;
+
+  struct {
+    struct spinlock lock;
+    struct inode *head;
+  } bucket[NIHASH];
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
+  struct inode *ip;
+  int i;
+
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  for(i = 0; i < NIHASH; i++)
+    initlock(&itable.bucket[i].lock, "itable bucket");
+
+  // Entries not holding any inode have inum 0, and are in
+  // no bucket.
+  itable.lru.prev = &itable.lru;
+  itable.lru.next = &itable.lru;
+  for(ip = itable.inode; ip < &itable.inode[NINODE]; ip++){
+    initsleeplock(&ip->lock, "inode");
+    ip->next = itable.lru.next;
+    ip->prev = &itable.lru;
+    itable.lru.next->prev = ip;
+    itable.lru.next = ip;
   }
 }
 
 static struct inode* iget(uint dev, uint inum);
 
-// Allocate an inode on device dev.
+// imap records which inodes are allocated, read from the
+// inode blocks at mount and kept up to date by ialloc() and
+// iput(), so that ialloc() needn't read them to find a free
+// one. next is where ialloc() looks first if the caller has
+// no preference.
+struct {
+  struct spinlock lock;
+  uchar used[(MAXINODES+7)/8];
+  uint next;
+} imap;
+
+static void
+imapinit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum;
+
+  if(sb.ninodes > MAXINODES)
+    panic("imapinit: too many inodes");
+  initlock(&imap.lock, "imap");
+  imap.used[0] |= 1;  // inode 0 is never used
+  imap.next = 1;
+  bp = 0;
+  for(inum = 1; inum < sb.ninodes; inum++){
+    if(bp == 0 || inum % IPB == 0){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, sb));
+    }
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type != 0)
+      imap.used[inum/8] |= 1 << (inum%8);
+  }
+  if(bp)
+    brelse(bp);
+}
+
+// Allocate an inode on device dev, in the same inode
+// block as inode near if one is free there.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode,
 // or NULL if there is no free inode.
 struct inode*
-ialloc(uint dev, short type)
+ialloc(uint dev, short type, uint near)
 {
-  int inum;
+  uint inum, i, n;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
+  acquire(&imap.lock);
+  inum = 0;
+  for(i = near - near%IPB; near > 0 && i < near - near%IPB + IPB; i++){
+    if(i < sb.ninodes && (imap.used[i/8] & (1 << (i%8))) == 0){
+      inum = i;
+      break;
     }
-    brelse(bp);
   }
-  printf("ialloc: no inodes\n");
-  return 0;
+  for(i = 0; inum == 0 && i < sb.ninodes - 1; i++){
+    n = 1 + (imap.next - 1 + i) % (sb.ninodes - 1);
+    if(n % 8 == 0 && imap.used[n/8] == 0xff){
+      i += 7;  // skip 8 inodes in use
+      continue;
+    }
+    if((imap.used[n/8] & (1 << (n%8))) == 0)
+      inum = n;
+  }
+  if(inum == 0){
+    release(&imap.lock);
+    printf("ialloc: no inodes\n");
+    return 0;
+  }
+  imap.used[inum/8] |= 1 << (inum%8);
+  imap.next = inum + 1;
+  release(&imap.lock);
+
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: inode in use");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  if(type != T_DEVICE)
+    dip->flags = DI_INLINE;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
 }
 
 // Copy a modified in-memory inode to disk.
@@ -235,9 +553,89 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  dip->flags = ip->flags;
+  memmove(dip->data, ip->data, sizeof(ip->data));
   log_write(bp);
   brelse(bp);
+  ip->logseq = log_seq();
+}
+
+static int
+ihash(uint dev, uint inum)
+{
+  return (dev * 7919 + inum) % NIHASH;
+}
+
+// Take ip off the LRU list. Does nothing if it isn't on it.
+// Caller holds itable.lock.
+static void
+lruremove(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+  ip->prev = ip->next = ip;
+}
+
+// Find (dev, inum) in bucket h and take a reference to it.
+// Caller holds bucket h's lock.
+static struct inode*
+ifind(int h, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = itable.bucket[h].head; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0){
+        acquire(&itable.lock);
+        lruremove(ip);
+        release(&itable.lock);
+      }
+      return ip;
+    }
+  }
+  return 0;
+}
+
+// Take the least recently used unreferenced entry out of
+// the table, for iget() to reuse.
+static struct inode*
+ievict(void)
+{
+  struct inode *ip, **pp;
+  uint dev, inum;
+  int h;
+
+  for(;;){
+    acquire(&itable.lock);
+    ip = itable.lru.prev;
+    if(ip == &itable.lru)
+      panic("iget: no inodes");
+    lruremove(ip);
+    dev = ip->dev;
+    inum = ip->inum;
+    h = ihash(dev, inum);
+    release(&itable.lock);
+    if(inum == 0)
+      return ip;
+
+    // Before we locked its bucket, iget() may have found it
+    // and iput() put it back on the list, or another ievict()
+    // may have taken it, so that it's in another bucket or
+    // none. It's ours only if it's still unreferenced, off the
+    // list, and in bucket h as (dev, inum).
+    acquire(&itable.bucket[h].lock);
+    if(ip->ref == 0 && ip->next == ip && ip->dev == dev && ip->inum == inum){
+      for(pp = &itable.bucket[h].head; *pp != 0 && *pp != ip; pp = &(*pp)->hnext)
+        ;
+      if(*pp == ip){
+        *pp = ip->hnext;
+        ip->inum = 0;
+        release(&itable.bucket[h].lock);
+        return ip;
+      }
+    }
+    release(&itable.bucket[h].lock);
+  }
 }
 
 // Find the inode with number inum on device dev
@@ -246,32 +644,42 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&itable.lock);
+  struct inode *ip, *e;
+  int h = ihash(dev, inum);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  acquire(&itable.bucket[h].lock);
+  ip = ifind(h, dev, inum);
+  release(&itable.bucket[h].lock);
+  if(ip)
+    return ip;
+
+  // Recycle an inode entry. The entry is in another bucket,
+  // so bucket h can't be locked meanwhile, and another
+  // iget() may have added the inode by the time it is again.
+  e = ievict();
+  acquire(&itable.bucket[h].lock);
+  if((ip = ifind(h, dev, inum)) != 0){
+    release(&itable.bucket[h].lock);
+    acquire(&itable.lock);
+    e->next = &itable.lru;
+    e->prev = itable.lru.prev;
+    itable.lru.prev->next = e;
+    itable.lru.prev = e;
+    release(&itable.lock);
+    return ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  ip = e;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
-  release(&itable.lock);
+  // changes from before it was cached may not be durable.
+  ip->logseq = ip->dataseq = log_seq();
+  ip->hnext = itable.bucket[h].head;
+  itable.bucket[h].head = ip;
+  release(&itable.bucket[h].lock);
 
   return ip;
 }
@@ -281,9 +689,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  int h = ihash(ip->dev, ip->inum);
+
+  acquire(&itable.bucket[h].lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&itable.bucket[h].lock);
   return ip;
 }
 
@@ -308,8 +718,11 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    ip->flags = dip->flags;
+    memmove(ip->data, dip->data, sizeof(ip->data));
     brelse(bp);
+    ip->elen = 0;
+    ip->bgoal = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -328,7 +741,7 @@ iunlock(struct inode *ip)
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
-// be recycled.
+// be recycled, least recently used first.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -336,7 +749,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  int h = ihash(ip->dev, ip->inum);
+
+  acquire(&itable.bucket[h].lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -345,20 +760,38 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&itable.bucket[h].lock);
 
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    dcpurge(ip->dev, ip->inum);
+    acquire(&imap.lock);
+    imap.used[ip->inum/8] &= ~(1 << (ip->inum%8));
+    release(&imap.lock);
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&itable.bucket[h].lock);
   }
 
-  ip->ref--;
-  release(&itable.lock);
+  if(--ip->ref == 0){
+    // an entry that would have to be read again anyway
+    // is the first to be reused.
+    acquire(&itable.lock);
+    if(ip->valid){
+      ip->next = itable.lru.next;
+      ip->prev = &itable.lru;
+    } else {
+      ip->next = &itable.lru;
+      ip->prev = itable.lru.prev;
+    }
+    ip->next->prev = ip;
+    ip->prev->next = ip;
+    release(&itable.lock);
+  }
+  release(&itable.bucket[h].lock);
 }
 
 // Common idiom: unlock, then put.
@@ -374,82 +807,489 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT], the singly indirect
+// block. ip->addrs[NDIRECT+1] is the doubly indirect block,
+// listing NINDIRECT more singly indirect blocks, and
+// ip->addrs[NDIRECT+2] the triply indirect block.
+//
+// In an FS_EXTENTS file system, ip->addrs[] instead holds the
+// root of a tree of extents (see fs.h). Files only grow at the
+// end, so blocks are only added along the tree's right edge.
+
+// The entries of extent tree node p, as extents or index entries.
+#define EXTHDR(p) ((struct extnode*)(p))
+#define EXTENTS(p) ((struct extent*)((char*)(p) + sizeof(struct extnode)))
+#define EXTIDX(p) ((struct extidx*)((char*)(p) + sizeof(struct extnode)))
+
+// Look up file block bn of extent-mapped ip. Returns its disk
+// block, and in *run how many blocks from it on are contiguous,
+// or 0 if bn isn't mapped.
+static uint
+elookup(struct inode *ip, uint bn, uint *run)
+{
+  struct buf *bp;
+  void *node;
+  struct extent *e;
+  struct extidx *x;
+  uint fbn, addr;
+  int i;
+
+  if(ip->elen > 0 && bn >= ip->efbn && bn < ip->efbn + ip->elen){
+    *run = ip->efbn + ip->elen - bn;
+    return ip->estart + bn - ip->efbn;
+  }
+
+  bp = 0;
+  node = ip->addrs;
+  fbn = 0;
+  while(EXTHDR(node)->depth > 0){
+    x = EXTIDX(node);
+    for(i = EXTHDR(node)->n - 1; i > 0 && x[i].fbn > bn; i--)
+      ;
+    fbn = x[i].fbn;
+    if(bp)
+      brelse(bp);
+    bp = breadclass(ip->dev, x[i].blk, IO_META);
+    node = bp->data;
+  }
 
-// Return the disk block address of the nth block in inode ip.
+  addr = 0;
+  e = EXTENTS(node);
+  for(i = 0; i < EXTHDR(node)->n; fbn += e[i].len, i++){
+    if(bn < fbn + e[i].len){
+      ip->efbn = fbn;
+      ip->estart = e[i].start;
+      ip->elen = e[i].len;
+      *run = fbn + e[i].len - bn;
+      addr = e[i].start + bn - fbn;
+      break;
+    }
+  }
+  if(bp)
+    brelse(bp);
+  return addr;
+}
+
+// Add the entry (a, b), which maps file blocks from fbn on, to
+// the end of node[l] on the right edge of ip's extent tree,
+// starting a new node if it's full. path[l-1] holds node[l].
+// returns 0 if out of disk space, or the tree is full.
+static int
+einsert(struct inode *ip, void **node, struct buf **path, int l,
+        uint a, uint b, uint fbn)
+{
+  struct extnode *h = EXTHDR(node[l]);
+  struct buf *bp;
+  uint blk, *ent;
+
+  if(h->n < (l == 0 ? NIEXTENT : NBEXTENT)){
+    ent = (uint*)EXTENTS(node[l]) + 2*h->n;
+    ent[0] = a;
+    ent[1] = b;
+    h->n++;
+    if(l > 0)
+      log_write(path[l-1]);
+    return 1;
+  }
+
+  if(l == 0 && h->depth == MAXEXTDEPTH)
+    return 0;
+  if((blk = balloc(ip->dev, 0, ip->bgoal)) == 0)
+    return 0;
+  bp = bread(ip->dev, blk);
+  if(l == 0){
+    // the root is full: move it down into the new block,
+    // and make that the root's only child.
+    memmove(bp->data, node[0], sizeof(struct extnode) +
+            NIEXTENT*sizeof(struct extent));
+    h->depth++;
+    h->n = 1;
+    EXTIDX(node[0])[0].fbn = 0;
+    EXTIDX(node[0])[0].blk = blk;
+  } else {
+    EXTHDR(bp->data)->n = 0;
+    EXTHDR(bp->data)->depth = h->depth;
+  }
+  h = EXTHDR(bp->data);
+  ent = (uint*)EXTENTS(bp->data) + 2*h->n;
+  ent[0] = a;
+  ent[1] = b;
+  h->n++;
+  log_write(bp);
+  brelse(bp);
+  if(l > 0 && !einsert(ip, node, path, l-1, fbn, blk, fbn)){
+    bfree(ip->dev, blk, 1);
+    return 0;
+  }
+  return 1;
+}
+
+// Map the next file blocks of extent-mapped ip, from bn on, to
+// up to *n new contiguous disk blocks, preferably the ones after
+// the last extent so it just grows. returns the first, and the
+// number in *n, or 0 if out of disk space.
+static uint
+eappend(struct inode *ip, uint bn, uint *n)
+{
+  struct buf *path[MAXEXTDEPTH];
+  void *node[MAXEXTDEPTH+1];
+  struct extnode *h;
+  struct extent *e;
+  uint fbn, addr, goal;
+  int d, depth, i;
+
+  depth = EXTHDR(ip->addrs)->depth;
+  node[0] = ip->addrs;
+  fbn = 0;
+  for(d = 0; d < depth; d++){
+    h = EXTHDR(node[d]);
+    fbn = EXTIDX(node[d])[h->n-1].fbn;
+    path[d] = breadclass(ip->dev, EXTIDX(node[d])[h->n-1].blk, IO_META);
+    node[d+1] = path[d]->data;
+  }
+  h = EXTHDR(node[depth]);
+  e = EXTENTS(node[depth]);
+  for(i = 0; i < h->n; i++)
+    fbn += e[i].len;
+  if(bn != fbn)
+    panic("eappend: hole");
+
+  goal = h->n > 0 ? e[h->n-1].start + e[h->n-1].len : ip->bgoal;
+  addr = ballocn(ip->dev, ip->type == T_FILE, goal, n);
+  if(addr != 0 && h->n > 0 && addr == goal){
+    e[h->n-1].len += *n;
+    if(depth > 0)
+      log_write(path[depth-1]);
+  } else if(addr != 0 && !einsert(ip, node, path, depth, addr, *n, bn)){
+    bfree(ip->dev, addr, *n);
+    addr = 0;
+  }
+
+  for(d = 0; d < depth; d++)
+    brelse(path[d]);
+  return addr;
+}
+
+// Free every block of extent tree node p, and of its subtrees.
+static void
+efree(struct inode *ip, void *p)
+{
+  struct buf *bp;
+  int i;
+
+  for(i = 0; i < EXTHDR(p)->n; i++){
+    if(EXTHDR(p)->depth == 0){
+      bfree(ip->dev, EXTENTS(p)[i].start, EXTENTS(p)[i].len);
+    } else {
+      bp = bread(ip->dev, EXTIDX(p)[i].blk);
+      efree(ip, bp->data);
+      brelse(bp);
+      bfree(ip->dev, EXTIDX(p)[i].blk, 1);
+    }
+  }
+}
+
+// Free the blocks mapping file blocks keep and up in extent tree
+// node p, which maps file blocks from fbn on, and keep some
+// below keep. The caller writes p back.
+static void
+etrim(struct inode *ip, void *p, uint fbn, uint keep)
+{
+  struct extnode *h = EXTHDR(p);
+  struct extent *e = EXTENTS(p);
+  struct extidx *x = EXTIDX(p);
+  struct buf *bp;
+  uint start, len;
+  int i, n;
+
+  if(h->depth == 0){
+    for(i = n = 0; i < h->n; i++, fbn += len){
+      start = e[i].start;
+      len = e[i].len;
+      if(fbn >= keep){
+        bfree(ip->dev, start, len);
+      } else {
+        n++;
+        if(fbn + len > keep){
+          bfree(ip->dev, start + keep - fbn, fbn + len - keep);
+          e[i].len = keep - fbn;
+        }
+      }
+    }
+    h->n = n;
+    return;
+  }
+
+  for(i = h->n - 1; x[i].fbn >= keep; i--){
+    bp = bread(ip->dev, x[i].blk);
+    efree(ip, bp->data);
+    brelse(bp);
+    bfree(ip->dev, x[i].blk, 1);
+  }
+  h->n = i + 1;
+  bp = bread(ip->dev, x[i].blk);
+  etrim(ip, bp->data, x[i].fbn, keep);
+  log_write(bp);
+  brelse(bp);
+}
+
+// Return the disk block address of the nth block in inode ip,
+// and in *run how many blocks from it on are contiguous.
 // If there is no such block, bmap allocates one.
 // returns 0 if out of disk space.
 static uint
-bmap(struct inode *ip, uint bn)
+bmap(struct inode *ip, uint bn, uint *run)
 {
-  uint addr, *a;
+  uint addr, *a, span, goal;
   struct buf *bp;
+  int l;
+
+  if(ip->flags & DI_INLINE)
+    panic("bmap: inline");
+  if(sb.features & FS_EXTENTS){
+    if((addr = elookup(ip, bn, run)) == 0){
+      *run = 1;
+      addr = eappend(ip, bn, run);
+    }
+    return addr;
+  }
 
+  *run = 1;
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, ip->type == T_FILE,
+                    bn > 0 ? ip->addrs[bn-1] + 1 : ip->bgoal);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
+      ip->bgoal = addr + 1;
     }
     return addr;
   }
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
+  // find the level l of the indirect tree holding bn, and
+  // span, the number of blocks that tree maps.
+  span = NINDIRECT;
+  for(l = 0; bn >= span; l++){
+    if(l == NINDLEVEL-1)
+      panic("bmap: out of range");
+    bn -= span;
+    span *= NINDIRECT;
+  }
+
+  // Load indirect blocks, allocating if necessary.
+  if((addr = ip->addrs[NDIRECT+l]) == 0){
+    addr = balloc(ip->dev, 0, ip->bgoal);
+    if(addr == 0)
+      return 0;
+    ip->addrs[NDIRECT+l] = addr;
+    ip->bgoal = addr + 1;
+  }
+  for(;;){
+    span /= NINDIRECT;  // blocks under each entry
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+    if((addr = a[bn / span]) == 0){
+      // the block after the previous data block, if it's here.
+      goal = span == 1 && bn > 0 && a[bn-1] ? a[bn-1] + 1 : ip->bgoal;
+      addr = balloc(ip->dev, span == 1 && ip->type == T_FILE, goal);
       if(addr){
-        a[bn] = addr;
+        a[bn / span] = addr;
         log_write(bp);
+        ip->bgoal = addr + 1;
       }
     }
     brelse(bp);
-    return addr;
+    if(addr == 0 || span == 1)
+      return addr;
+    bn %= span;
   }
-
-  panic("bmap: out of range");
 }
 
-// Truncate inode (discard contents).
-// Caller must hold ip->lock.
-void
-itrunc(struct inode *ip)
+// Free the blocks listed in indirect block addr, which is
+// level more levels of indirect blocks deep, except those that
+// map its first keep data blocks; if keep is 0, free addr too.
+// Data blocks that are contiguous on disk are freed together.
+static void
+bfreeind(struct inode *ip, uint addr, int level, uint keep)
 {
-  int i, j;
   struct buf *bp;
-  uint *a;
+  uint *a, start, n, span, first;
+  int j, l, changed;
+
+  span = 1;  // data blocks under each entry
+  for(l = 0; l < level; l++)
+    span *= NINDIRECT;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  start = n = 0;
+  changed = 0;
+  for(j = 0; j < NINDIRECT; j++){
+    first = j * span;
+    if(a[j] == 0 || first + span <= keep)
+      continue;
+    if(level > 0){
+      bfreeind(ip, a[j], level-1, first < keep ? keep - first : 0);
+    } else if(n > 0 && a[j] == start + n){
+      n++;
+    } else {
+      if(n > 0)
+        bfree(ip->dev, start, n);
+      start = a[j];
+      n = 1;
+    }
+    if(first >= keep){
+      a[j] = 0;
+      changed = 1;
+    }
+  }
+  if(n > 0)
+    bfree(ip->dev, start, n);
+  if(keep > 0 && changed)
+    log_write(bp);
+  brelse(bp);
+  if(keep == 0)
+    bfree(ip->dev, addr, 1);
+}
 
-  for(i = 0; i < NDIRECT; i++){
+// Free the blocks holding ip's file blocks keep and up.
+static void
+ifree(struct inode *ip, uint keep)
+{
+  uint base, span;
+  int i;
+
+  ip->elen = 0;
+  if(ip->flags & DI_INLINE){
+    if(keep == 0)
+      memset(ip->data, 0, sizeof(ip->data));
+    return;
+  }
+  if(sb.features & FS_EXTENTS){
+    if(keep == 0){
+      efree(ip, ip->addrs);
+      memset(ip->addrs, 0, sizeof(ip->addrs));
+    } else {
+      etrim(ip, ip->addrs, 0, keep);
+    }
+    return;
+  }
+
+  for(i = keep < NDIRECT ? keep : NDIRECT; i < NDIRECT; i++){
     if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
+      bfree(ip->dev, ip->addrs[i], 1);
       ip->addrs[i] = 0;
     }
   }
-
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  base = NDIRECT;
+  span = NINDIRECT;
+  for(i = 0; i < NINDLEVEL; i++, base += span, span *= NINDIRECT){
+    if(ip->addrs[NDIRECT+i] && keep < base + span){
+      bfreeind(ip, ip->addrs[NDIRECT+i], i, keep > base ? keep - base : 0);
+      if(keep <= base)
+        ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
+}
 
+// Move inline ip's contents to a block, so that it can grow
+// past NINLINE bytes. The block is written as writei() would,
+// since writei() may write it again in the same transaction.
+// returns 0, or -1 if out of disk space.
+// Caller must hold ip->lock.
+static int
+iexpand(struct inode *ip)
+{
+  char data[NINLINE];
+  struct buf *bp;
+  uint addr, run;
+
+  memmove(data, ip->data, sizeof(data));
+  memset(ip->data, 0, sizeof(ip->data));
+  ip->flags &= ~DI_INLINE;
+  ip->elen = 0;
+  if(ip->size == 0)
+    return 0;
+  if((addr = bmap(ip, 0, &run)) == 0){
+    memmove(ip->data, data, sizeof(data));
+    ip->flags |= DI_INLINE;
+    return -1;
+  }
+  bp = breadclass(ip->dev, addr, ip->type == T_DIR ? IO_META : IO_DATA);
+  memmove(bp->data, data, ip->size);
+  if(ip->type == T_FILE){
+    bwrite(bp);
+    log_ordered();
+  } else {
+    log_write(bp);
+  }
+  brelse(bp);
+  return 0;
+}
+
+// Truncate inode (discard contents).
+// Caller must hold ip->lock.
+void
+itrunc(struct inode *ip)
+{
+  ifree(ip, 0);
+  // it's small again.
+  if(ip->type != T_DEVICE)
+    ip->flags |= DI_INLINE;
   ip->size = 0;
   iupdate(ip);
+  ip->dataseq = ip->logseq;
+}
+
+// Reserve disk blocks for ip's contents up to byte off, past
+// its end, for fallocate(). They are allocated contiguously
+// as far as possible, and aren't zeroed: the file's size
+// doesn't change, so they can't be read until they've been
+// written. returns 0, or -1 if out of disk space.
+// Caller must hold ip->lock.
+int
+ireserve(struct inode *ip, uint off)
+{
+  uint bn, end, run;
+  int r = 0;
+
+  if(off > MAXFILE*BSIZE)
+    return -1;
+  if(ip->flags & DI_INLINE){
+    if(off <= NINLINE)
+      return 0;
+    if(iexpand(ip) < 0)
+      return -1;
+  }
+  end = (off + BSIZE - 1) / BSIZE;
+  for(bn = (ip->size + BSIZE - 1) / BSIZE; bn < end; bn += run){
+    if(sb.features & FS_EXTENTS){
+      if(elookup(ip, bn, &run) == 0){
+        run = end - bn;
+        if(eappend(ip, bn, &run) == 0){
+          r = -1;
+          break;
+        }
+      }
+    } else if(bmap(ip, bn, &run) == 0){
+      r = -1;
+      break;
+    }
+  }
+  iupdate(ip);
+  return r;
+}
+
+// Give back the blocks ireserve() reserved past the end of
+// ip that haven't been written.
+// Caller must hold ip->lock.
+void
+itrim(struct inode *ip)
+{
+  ifree(ip, (ip->size + BSIZE - 1) / BSIZE);
+  iupdate(ip);
 }
 
 // Copy stat information from inode.
@@ -471,7 +1311,7 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr, run;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -479,11 +1319,22 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  if(ip->flags & DI_INLINE){
+    if(either_copyout(user_dst, dst, ip->data + off, n) == -1)
+      return -1;
+    return n;
+  }
+
+  addr = run = 0;
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
-    if(addr == 0)
+    // the next block of a contiguous run needs no lookup.
+    if(off%BSIZE == 0 && run > 1){
+      addr++;
+      run--;
+    } else if((addr = bmap(ip, off/BSIZE, &run)) == 0){
       break;
-    bp = bread(ip->dev, addr);
+    }
+    bp = breadclass(ip->dev, addr, ip->type == T_DIR ? IO_META : IO_DATA);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -507,38 +1358,83 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  struct buf *wb[NWRITEI];  // data writes in flight
+  int i, nwb;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  if((ip->flags & DI_INLINE) && off + n > NINLINE && iexpand(ip) < 0)
+    return -1;
 
-  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    uint addr = bmap(ip, off/BSIZE);
+  nwb = 0;
+  tot = 0;
+  if(ip->flags & DI_INLINE){
+    // iupdate() below writes it.
+    if(either_copyin(ip->data + off, user_src, src, n) == -1)
+      return -1;
+    tot = n;
+    off += n;
+  }
+  for(; tot<n; tot+=m, off+=m, src+=m){
+    uint run;
+    uint addr = bmap(ip, off/BSIZE, &run);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
+    bp = breadclass(ip->dev, addr, ip->type == T_DIR ? IO_META : IO_DATA);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
       break;
     }
-    log_write(bp);
-    brelse(bp);
+    if(ip->type == T_FILE){
+      // ordered data: write the block home rather than to the
+      // log, keeping a few writes going at once.
+      if(nwb >= NWRITEI){
+        bwait(wb[nwb % NWRITEI]);
+        brelse(wb[nwb % NWRITEI]);
+      }
+      bawrite(bp);
+      wb[nwb++ % NWRITEI] = bp;
+    } else {
+      log_write(bp);
+      brelse(bp);
+    }
   }
+  for(i = nwb > NWRITEI ? nwb - NWRITEI : 0; i < nwb; i++){
+    bwait(wb[i % NWRITEI]);
+    brelse(wb[i % NWRITEI]);
+  }
+  if(nwb > 0)
+    log_ordered();  // the commit must flush them first
 
   if(off > ip->size)
     ip->size = off;
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
+  // block to ip->addrs[], or the data is in the i-node.
   iupdate(ip);
+  ip->dataseq = ip->logseq;
 
   return tot;
 }
 
 // Directories
+//
+// A directory is searched from start to end, unless it is
+// indexed (see struct dxroot in fs.h), when only block 0 and
+// one leaf need be read. A directory starts unindexed, and is
+// indexed when it first outgrows one block. Directories made
+// by mkfs stay unindexed, whatever their size.
+//
+// dcache remembers what recent dirlookup()s found, including
+// names that weren't there, so that looking them up again
+// needn't read the directory. Entries for a directory are
+// only used or changed with that directory locked; dirlink(),
+// unlink (with dirforget()) and freeing the directory drop
+// the ones that are no longer right.
 
 int
 namecmp(const char *s, const char *t)
@@ -546,6 +1442,227 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+#define NDHASH 31
+
+struct dentry {
+  uint dev;
+  uint parent;          // directory's inum; 0 if unused
+  char name[DIRSIZ];
+  uint inum;            // 0 if name isn't in the directory
+  uint off;             // where its dirent is, if it is
+  struct dentry *next;  // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry e[NDENTRY];
+  struct dentry *hash[NDHASH];
+  int hand;             // next entry to reuse
+  uint64 nhit, nneg, nmiss;
+} dcache;
+
+static uint dirhash(char*);
+
+static struct dentry**
+dchain(uint dev, uint parent, char *name)
+{
+  return &dcache.hash[(dirhash(name) ^ parent ^ dev) % NDHASH];
+}
+
+// Find (dev, parent, name) in dcache, and return a pointer
+// to the link to it. Caller holds dcache.lock.
+static struct dentry**
+dcfind(uint dev, uint parent, char *name)
+{
+  struct dentry **pp;
+
+  for(pp = dchain(dev, parent, name); *pp; pp = &(*pp)->next)
+    if((*pp)->dev == dev && (*pp)->parent == parent &&
+       namecmp((*pp)->name, name) == 0)
+      break;
+  return pp;
+}
+
+// Remove e from its hash chain and mark it unused.
+// Caller holds dcache.lock.
+static void
+dcdrop(struct dentry *e)
+{
+  struct dentry **pp;
+
+  for(pp = dchain(e->dev, e->parent, e->name); *pp != e; pp = &(*pp)->next)
+    ;
+  *pp = e->next;
+  e->parent = 0;
+}
+
+// Look up name in directory dp in dcache. returns 0 if
+// it's not cached, 1 if it is, with its inum (0 if it
+// isn't in dp) and dirent offset in *inum and *off.
+// Caller must hold dp->lock.
+static int
+dcget(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dentry *e;
+
+  acquire(&dcache.lock);
+  if((e = *dcfind(dp->dev, dp->inum, name)) == 0){
+    dcache.nmiss++;
+    release(&dcache.lock);
+    return 0;
+  }
+  *inum = e->inum;
+  *off = e->off;
+  if(e->inum)
+    dcache.nhit++;
+  else
+    dcache.nneg++;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Remember that name in directory dp is inum, at offset off.
+// Caller must hold dp->lock.
+static void
+dcput(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *e;
+
+  acquire(&dcache.lock);
+  if((e = *dcfind(dp->dev, dp->inum, name)) == 0){
+    e = &dcache.e[dcache.hand];
+    dcache.hand = (dcache.hand + 1) % NDENTRY;
+    if(e->parent)
+      dcdrop(e);
+    e->dev = dp->dev;
+    e->parent = dp->inum;
+    strncpy(e->name, name, DIRSIZ);
+    e->next = *dchain(e->dev, e->parent, e->name);
+    *dchain(e->dev, e->parent, e->name) = e;
+  }
+  e->inum = inum;
+  e->off = off;
+  release(&dcache.lock);
+}
+
+// Forget about name in directory dp, since it's been
+// added or removed.
+// Caller must hold dp->lock.
+void
+dirforget(struct inode *dp, char *name)
+{
+  struct dentry *e;
+
+  acquire(&dcache.lock);
+  if((e = *dcfind(dp->dev, dp->inum, name)) != 0)
+    dcdrop(e);
+  release(&dcache.lock);
+}
+
+static void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static void
+dcstat(struct fsstat *st)
+{
+  acquire(&dcache.lock);
+  st->ndchit = dcache.nhit;
+  st->ndcneg = dcache.nneg;
+  st->ndcmiss = dcache.nmiss;
+  release(&dcache.lock);
+}
+
+// Forget everything about directory inum, which is being
+// freed or has had its entries moved.
+static void
+dcpurge(uint dev, uint inum)
+{
+  int i;
+
+  acquire(&dcache.lock);
+  for(i = 0; i < NDENTRY; i++)
+    if(dcache.e[i].parent == inum && dcache.e[i].dev == dev)
+      dcdrop(&dcache.e[i]);
+  release(&dcache.lock);
+}
+
+// FNV-1a hash of a directory entry name.
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261U;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Read block bn of directory dp.
+static struct buf*
+dirblock(struct inode *dp, uint bn)
+{
+  uint run, addr;
+
+  if((addr = bmap(dp, bn, &run)) == 0)
+    return 0;
+  return breadclass(dp->dev, addr, IO_META);
+}
+
+// If dp is indexed, return its block 0 in *rbp, and the index
+// entry whose leaf would hold names that hash to h.
+// Otherwise return -1.
+static int
+dxlookup(struct inode *dp, uint h, struct buf **rbp)
+{
+  struct buf *bp;
+  struct dxroot *r;
+  int lo, hi, mid;
+
+  if(dp->size <= BSIZE || (bp = dirblock(dp, 0)) == 0)
+    return -1;
+  r = (struct dxroot*)bp->data;
+  if(r->zero != 0 || r->magic != DXMAGIC){
+    brelse(bp);
+    return -1;
+  }
+  // the last entry with hash <= h; entry 0's hash is 0.
+  lo = 0;
+  hi = r->n - 1;
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(r->e[mid].hash <= h)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  *rbp = bp;
+  return lo;
+}
+
+// Find the name in directory block bp, block bn of its
+// directory, from dirent first on.
+static uint
+dirscan(struct buf *bp, uint bn, int first, char *name, uint *poff)
+{
+  struct dirent *de = (struct dirent*)bp->data;
+  int i;
+
+  for(i = first; i < BSIZE / sizeof(*de); i++){
+    if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+      if(poff)
+        *poff = bn * BSIZE + i * sizeof(*de);
+      return de[i].inum;
+    }
+  }
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -553,10 +1670,39 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  struct dxroot *r;
+  struct buf *rbp, *bp;
+  int i;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dcget(dp, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  off = 0;
+  if((i = dxlookup(dp, dirhash(name), &rbp)) >= 0){
+    // "." and ".." are in block 0, the rest in the leaves.
+    r = (struct dxroot*)rbp->data;
+    if((inum = dirscan(rbp, 0, 0, name, &off)) == 0 && i < r->n &&
+       (bp = dirblock(dp, r->e[i].block)) != 0){
+      inum = dirscan(bp, r->e[i].block, 0, name, &off);
+      brelse(bp);
+    }
+    brelse(rbp);
+    dcput(dp, name, inum, off);
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -567,21 +1713,193 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcput(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcput(dp, name, 0, 0);
   return 0;
 }
 
+// Move the dirents in directory block from, except the first
+// skip, whose names hash to at least h, into block to, which
+// has room.
+static void
+dirmove(struct buf *from, int skip, struct buf *to, uint h)
+{
+  struct dirent *s = (struct dirent*)from->data;
+  struct dirent *d = (struct dirent*)to->data;
+  int i, j;
+
+  for(i = skip, j = 0; i < BSIZE / sizeof(*s); i++){
+    if(s[i].inum == 0 || dirhash(s[i].name) < h)
+      continue;
+    while(d[j].inum != 0)
+      j++;
+    d[j] = s[i];
+    memset(&s[i], 0, sizeof(s[i]));
+  }
+}
+
+// Choose where to split full directory block bp, from dirent
+// skip on: a hash at the middle of theirs, greater than the
+// least so both halves are non-empty.
+// returns 0 if they all have the same hash.
+static uint
+dirsplit(struct buf *bp, int skip)
+{
+  struct dirent *de = (struct dirent*)bp->data;
+  uint least, next, lo, hi, mid, h;
+  int i, n, le;
+
+  // the least hash, and the next greater one (0 if none).
+  least = dirhash(de[skip].name);
+  next = 0;
+  for(i = skip + 1, n = 1; i < BSIZE / sizeof(*de); i++, n++){
+    h = dirhash(de[i].name);
+    if(h < least){
+      next = least;
+      least = h;
+    } else if(h > least && (next == 0 || h < next))
+      next = h;
+  }
+  if(next == 0)
+    return 0;
+
+  // the median: the least m with more than half the hashes
+  // <= m. binary search for it, rather than sort a block's
+  // worth of hashes on the stack.
+  lo = least;
+  hi = 0xffffffff;
+  while(lo < hi){
+    mid = lo + (hi - lo) / 2;
+    for(i = skip, le = 0; i < BSIZE / sizeof(*de); i++)
+      if(dirhash(de[i].name) <= mid)
+        le++;
+    if(le > n / 2)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo > least ? lo : next;
+}
+
+// Index dp, whose one block is full: move its dirents other
+// than "." and ".." into two new leaves, split by hash, and
+// put the index in their place.
+// returns 0 on success, -1 on failure.
+static int
+dxcreate(struct inode *dp)
+{
+  struct buf *rbp, *l1, *l2;
+  struct dxroot *r;
+  uint m;
+
+  if((rbp = dirblock(dp, 0)) == 0)
+    return -1;
+  if((m = dirsplit(rbp, 2)) == 0 ||
+     (l1 = dirblock(dp, 1)) == 0){
+    brelse(rbp);
+    return -1;
+  }
+  if((l2 = dirblock(dp, 2)) == 0){
+    brelse(l1);
+    brelse(rbp);
+    return -1;
+  }
+  dirmove(rbp, 2, l2, m);
+  dirmove(rbp, 2, l1, 0);
+  dcpurge(dp->dev, dp->inum);  // cached offsets have moved
+  r = (struct dxroot*)rbp->data;
+  r->magic = DXMAGIC;
+  r->n = 2;
+  r->e[0].hash = 0;
+  r->e[0].block = 1;
+  r->e[1].hash = m;
+  r->e[1].block = 2;
+  log_write(rbp);
+  log_write(l1);
+  log_write(l2);
+  brelse(l2);
+  brelse(l1);
+  brelse(rbp);
+  dp->size = 3*BSIZE;
+  iupdate(dp);
+  return 0;
+}
+
+// Add (name, inum), whose name hashes to h, to indexed
+// directory dp, whose block 0 is rbp, in the leaf of entry i,
+// splitting the leaf if it's full. Releases rbp.
+// returns 0 on success, -1 on failure.
+static int
+dxlink(struct inode *dp, struct buf *rbp, int i, char *name, uint inum, uint h)
+{
+  struct dxroot *r = (struct dxroot*)rbp->data;
+  struct buf *bp, *nbp;
+  struct dirent *de;
+  uint m, nb;
+  int j;
+
+  if((bp = dirblock(dp, r->e[i].block)) == 0)
+    goto bad;
+  de = (struct dirent*)bp->data;
+  for(j = 0; j < BSIZE / sizeof(*de) && de[j].inum != 0; j++)
+    ;
+
+  if(j == BSIZE / sizeof(*de)){
+    // full: move the upper half of its hashes to a new leaf.
+    nb = dp->size / BSIZE;
+    if(r->n == NDXENTRY || (m = dirsplit(bp, 0)) == 0 ||
+       (nbp = dirblock(dp, nb)) == 0){
+      brelse(bp);
+      goto bad;
+    }
+    dirmove(bp, 0, nbp, m);
+    dcpurge(dp->dev, dp->inum);
+    memmove(&r->e[i+2], &r->e[i+1], (r->n - i - 1) * sizeof(r->e[0]));
+    r->e[i+1].hash = m;
+    r->e[i+1].block = nb;
+    r->n++;
+    log_write(rbp);
+    log_write(bp);
+    dp->size += BSIZE;
+    iupdate(dp);
+    if(h >= m){
+      brelse(bp);
+      bp = nbp;
+    } else {
+      log_write(nbp);
+      brelse(nbp);
+    }
+    de = (struct dirent*)bp->data;
+    for(j = 0; de[j].inum != 0; j++)
+      ;
+  }
+
+  strncpy(de[j].name, name, DIRSIZ);
+  de[j].inum = inum;
+  log_write(bp);
+  brelse(bp);
+  brelse(rbp);
+  return 0;
+
+bad:
+  brelse(rbp);
+  return -1;
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 // Returns 0 on success, -1 on failure (e.g. out of disk blocks).
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
+  int off, i;
   struct dirent de;
   struct inode *ip;
+  struct buf *rbp;
+  uint h;
 
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -589,6 +1907,11 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  dirforget(dp, name);
+  h = dirhash(name);
+  if((i = dxlookup(dp, h, &rbp)) >= 0)
+    return dxlink(dp, rbp, i, name, inum, h);
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -597,6 +1920,13 @@ dirlink(struct inode *dp, char *name, uint inum)
       break;
   }
 
+  // a full one-block directory gets an index rather than
+  // a second block.
+  if(off == BSIZE && dp->size == BSIZE && dxcreate(dp) == 0 &&
+     (i = dxlookup(dp, h, &rbp)) >= 0)
+    return dxlink(dp, rbp, i, name, inum, h);
+
+  memset(&de, 0, sizeof(de));
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
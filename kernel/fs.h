@@ -3,7 +3,9 @@
 
 
 #define ROOTINO  1   // root i-number
-#define BSIZE 1024  // block size
+#ifndef BSIZE
+#define BSIZE 4096  // block size; a multiple of 512 (see Makefile)
+#endif
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
@@ -20,13 +22,39 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint logdev;       // Device holding the log, or 0 for this one
+  uint features;     // FS_* flags
+  uint bsize;        // Block size, which must be BSIZE
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+#define FS_EXTENTS 0x1  // files are mapped by extents, not addrs[]
+
+// A disk that is a member of a striped (RAID-0) set starts with
+// a label block. The set's blocks follow it, a stripe unit at a
+// time, round robin across the members: set block b is in stripe
+// unit b/stripe, which lives on member (b/stripe) % ndisks.
+struct disklabel {
+  uint magic;        // Must be LABELMAGIC
+  uint ndisks;       // Number of members in the set
+  uint index;        // This member's position in the set
+  uint stripe;       // Blocks per stripe unit
+};
+
+#define LABELMAGIC 0x10203041
+
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NINDLEVEL 3  // singly, doubly and triply indirect blocks
+// Largest file, in blocks. The size is a uint, so this is less
+// than addrs[] can map.
+#define MAXFILE (0xffffffffU / BSIZE)
+
+// A file or directory of at most NINLINE bytes is kept in its
+// inode, in place of the block addresses, and has no blocks.
+#define NINLINE 112
+#define DI_INLINE 0x1   // contents are in data[], not in blocks
 
 // On-disk inode structure
 struct dinode {
@@ -35,9 +63,38 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint flags;           // DI_* flags
+  union {
+    uint addrs[NDIRECT+NINDLEVEL];   // Data block addresses
+    char data[NINLINE];              // or the contents (DI_INLINE)
+  };
+};
+
+// Extent-mapped files (FS_EXTENTS). A file has no holes, so an
+// extent, a leaf entry, is just a run of disk blocks; the file
+// blocks it maps follow those mapped by the extents before it.
+// An index entry names the node that maps file blocks from fbn
+// on. The root node is in addrs[]; the others fill a block. A
+// node is a struct extnode followed by its entries.
+struct extnode {
+  ushort n;       // entries in use
+  ushort depth;   // 0 for a leaf
+};
+
+struct extent {
+  uint start;     // first disk block
+  uint len;       // number of blocks
 };
 
+struct extidx {
+  uint fbn;       // first file block mapped by the node
+  uint blk;       // block holding the node
+};
+
+#define NIEXTENT ((sizeof(((struct dinode*)0)->addrs) - sizeof(struct extnode)) / sizeof(struct extent))
+#define NBEXTENT ((BSIZE - sizeof(struct extnode)) / sizeof(struct extent))
+#define MAXEXTDEPTH 2   // levels of extent blocks below the root
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -47,6 +104,9 @@ struct dinode {
 // Bitmap bits per block
 #define BPB           (BSIZE*8)
 
+// Bitmap blocks in a file system of sb.size blocks
+#define NBITMAP(sb)   ((sb).size/BPB + 1)
+
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
 
@@ -54,7 +114,36 @@ struct dinode {
 #define DIRSIZ 14
 
 struct dirent {
-  ushort inum;
+  uint inum;
   char name[DIRSIZ];
+  char pad[14];   // to 32 bytes, which divides BSIZE
+};
+
+// A directory of more than one block may be indexed by a hash
+// of the names. Its block 0 is then a struct dxroot: "." and
+// "..", then an index sorted by hash. Entry i says that the
+// dirents whose names hash to at least hash, and less than
+// entry i+1's hash, are all in block block, a leaf. The header
+// and entries are the size of dirents, with inum 0, so that
+// the index reads as free dirents to programs listing the
+// directory.
+struct dxentry {
+  uint zero;      // 0
+  uint hash;      // least hash in the leaf
+  uint block;     // directory (file) block number of the leaf
+  uint pad[5];
+};
+
+#define DXMAGIC 0x6478  // "xd"
+#define NDXENTRY ((BSIZE - 3*sizeof(struct dirent)) / sizeof(struct dxentry))
+
+struct dxroot {
+  struct dirent dot;
+  struct dirent dotdot;
+  uint zero;      // 0
+  ushort magic;   // DXMAGIC
+  ushort n;       // entries in use
+  ushort pad[12];
+  struct dxentry e[NDXENTRY];
 };
 
@@ -0,0 +1,17 @@
+// Block allocator counters and free space, shared between the
+// kernel and the fsstat() system call.
+
+struct fsstat {
+  uint nblocks;   // blocks in the file system
+  uint nfree;     // free blocks
+  uint ngroup;    // allocation groups
+  uint nrun;      // runs of contiguous blocks in the file asked about
+  uint64 nalloc;  // balloc() calls
+  uint64 nblock;  // blocks they allocated
+  uint64 ngoal;   // calls that got the block they asked for
+  uint64 nscan;   // bitmap blocks they searched
+  uint64 ticks;   // time they took, in time CSR ticks
+  uint64 ndchit;  // dirlookup()s the name cache answered: found
+  uint64 ndcneg;  //   not found
+  uint64 ndcmiss; // dirlookup()s that searched the directory
+};
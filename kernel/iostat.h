@@ -0,0 +1,23 @@
+// Disk request latency histograms and queue depth samples,
+// summed over all virtio disks, shared between the kernel and
+// user programs that read the iostat device. Writing to the
+// device resets them.
+
+// who a block belongs to (struct buf's class).
+#define IO_META   0  // inodes, bitmap, directories, indirect blocks
+#define IO_DATA   1  // file contents
+#define IO_LOG    2  // the log
+#define NIOCLASS  3
+
+#define NLATBUCKET 20  // latency buckets
+#define NQDEPTH    16  // queue depth buckets
+
+struct iostat {
+  // lat[write][class][i] counts requests that took between
+  // 2^i and 2^(i+1) time CSR ticks; the last bucket counts
+  // anything slower.
+  uint64 lat[2][NIOCLASS][NLATBUCKET];
+  // qdepth[i] counts requests submitted with i others already
+  // in flight on the same disk; the last bucket counts more.
+  uint64 qdepth[NQDEPTH];
+};
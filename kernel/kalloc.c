@@ -26,8 +26,18 @@ struct {
 void
 kinit()
 {
+  uint64 rdsize;
+
   initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+
+  // don't hand out the pages of a disk image
+  // that qemu -initrd loaded for ramdisk.c.
+  if((rdsize = ramdisksize()) > 0){
+    freerange(end, (void*)RAMDISK);
+    freerange((void*)(RAMDISK + rdsize), (void*)PHYSTOP);
+  } else {
+    freerange(end, (void*)PHYSTOP);
+  }
 }
 
 void
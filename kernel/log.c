@@ -6,135 +6,456 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "iostat.h"
+#include "proc.h"
+#include "logmode.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction only commits when none of its FS system
+// calls are active. Thus there is never any reasoning required
+// about whether a commit might write an uncommitted system
+// call's updates to disk.
 //
-// A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// A system call should call begin_op(n)/end_op() to mark
+// its start and end, where n is the most blocks it can add
+// to the log (see the *OPBLOCKS constants in param.h). Usually
+// begin_op() just reserves n blocks of log space in the open
+// transaction and returns. log_write() charges each block the
+// call adds to the log against that reservation; blocks that
+// other calls already logged are free, and end_op() gives back
+// what's left. end_op() returns once the transaction is
+// durable, if the call logged anything.
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// Commits are grouped: while one transaction is being written,
+// the next one takes new system calls, and commits when its last
+// call ends after that. begin_op() closes the open transaction,
+// and waits for its calls to end, only if it is close to running
+// out of log space or has been open for COMMITTICKS. A closed
+// transaction's blocks are copied aside, so that the next one can
+// change the cached blocks while the copy is written.
+//
+// In delayed mode (see logmode()) end_op() returns at once, and
+// the commit kernel thread commits the open transaction once it
+// is COMMITDELAY ticks old; so does begin_op() when the log is
+// close to full. The crash-safety contract is then:
+//   - after a crash, the file system is as it was at the end of
+//     some transaction: every system call's updates are there in
+//     full or not at all, and calls are never reordered.
+//   - a file's data is never newer than its metadata says, nor
+//     garbage: blocks a file gained are written before the
+//     transaction that gives them to it (ordered data, below).
+//   - up to COMMITDELAY ticks of updates may be lost, except
+//     that when fsync(fd) returns, all of the file's updates,
+//     and all updates of calls before them, are durable;
+//     fdatasync(fd) only waits for those that changed its
+//     contents or size. A new file's directory entry is covered
+//     by fsync() of the directory, or of anything later.
+// In sync mode, the default, a call's updates are durable when
+// it returns.
+//
+// The log is a physical re-do log containing disk blocks, used
+// as a circular journal of committed transactions:
+//   log super block: where the oldest transaction not yet
+//     installed starts, and its number
+//   header block, containing the transaction's number, a
+//     checksum, and block #s for block A, B, C, ...
 //   block A
 //   block B
-//   block C
 //   ...
-// Log appends are synchronous.
+//   header block of the next transaction
+//   ...
+// The log is on the file system's device at sb.logstart, or at
+// sb.logstart on device sb.logdev, so that commits need not
+// queue behind installs and data writes.
+//
+// A transaction commits with one write of its header and
+// blocks, followed by a cache flush. Recovery replays the
+// transactions that follow one another by number and whose
+// checksums are right; a torn or stale transaction ends it.
+// Nothing has to be erased.
+//
+// Committed transactions are installed (copied to their home
+// locations) in the background by the checkpoint kernel thread,
+// all that are committed at once, when the log is half full; a
+// commit that finds no room waits for it. Until then their
+// blocks stay pinned in the cache, so reads see them, and a copy
+// of the on-disk log in memory is what gets installed. A block
+// logged by several transactions is installed just once. Their
+// log space is reused only once the log super block says they
+// are installed.
+//
+// Blocks freed by a transaction are collected in runs and
+// discarded once the transaction is installed, so the device
+// can drop their storage. Before then a crash could bring
+// them back. Discards are advisory: runs that don't fit in
+// discard[] are simply not discarded.
+//
+// The data blocks of regular files aren't logged (ordered data
+// mode): writei() writes them straight home, and commit()
+// flushes them before the transaction that points to them is
+// written. So a block may be allocated only once no crash can
+// bring back an older use of it: not while the transaction
+// that freed it is uncommitted, and not while the log still
+// holds a copy of it to install (see log_inuse()).
+
+#define LOGMAGIC 0x10c0ffee
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// Contents of a transaction's header block, also used to keep
+// track in memory of logged block# before commit.
 struct logheader {
+  uint magic;
+  uint seq;   // transaction number
+  uint crc;   // CRC32C of this block (with crc 0) and the logged blocks
   int n;
   int block[LOGSIZE];
 };
 
+// Contents of the log's first block.
+struct logsuper {
+  uint tail;  // position of the oldest transaction not installed
+  uint seq;   // and its number
+};
+
+// A transaction in memory.
+struct trans {
+  struct logheader lh;
+  uint pos;   // where it is in the log, once committed
+  int ordered;  // wrote data blocks home (see log_ordered())
+  int ndiscard;
+  struct {
+    uint start;
+    uint n;
+  } discard[NDISCARD];  // runs of blocks freed by this transaction
+};
+
+// Positions in the log count from the block after the log
+// super block. log.data[1+p] holds the block at position p.
+
 struct log {
+  // the log super block, then a copy of the rest of the log.
+  // first, so that headers are aligned.
+  uchar data[NLOG][BSIZE];
+  struct buf buf[NLOG];   // for installing data[i]
+  struct buf *pin[NLOG];  // the cached block data[i] is a copy of
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in the log, super block included
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they may still add.
+  int closed;      // open transaction takes no new sys calls.
+  int committing;  // in commit(), writing a transaction.
+  int install;     // the checkpoint thread has work to do.
+  int delayed;     // LOG_DELAYED: end_op() doesn't wait for commits.
+  int seq;         // number of the open transaction.
+  int done;        // number of the last durable transaction.
+  uint opened;     // ticks when cur logged its first block.
   int dev;
-  struct logheader lh;
+  int logdev;      // where the log is: dev, or a device of its own
+  // blocks freed by the open transaction and the one being
+  // committed, bit b of freed[seq%2] for block b.
+  uchar freed[2][(MAXBITMAP*BPB+7)/8];
+  uint nfreed;     // bytes of each in use: one bit per fs block
+  struct sleeplock discarding;  // held while discarding runs
+  struct trans cur;  // the open transaction
+  // committed transactions tailseq..done, and the one being
+  // committed, by number % NLOGREC. they lie in the log from
+  // position tail up to head.
+  struct trans rec[NLOGREC];
+  int tailseq;
+  uint tail;
+  uint head;
 };
 struct log log;
 
+static uint crctab[256];
+
 static void recover_from_log(void);
 static void commit();
+static void discard_trans(struct trans *);
+static void checkpointer(void);
+static void committer(void);
+
+static void
+crcinit(void)
+{
+  uint c;
+  int i, k;
+
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (k = 0; k < 8; k++)
+      c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+    crctab[i] = c;
+  }
+}
+
+static uint
+crc32c(uchar *p, uint n)
+{
+  uint c = ~0;
+
+  while (n-- > 0)
+    c = crctab[(c ^ *p++) & 0xff] ^ (c >> 8);
+  return ~c;
+}
 
 void
 initlog(int dev, struct superblock *sb)
 {
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
+  if (sb->nlog < LOGSIZE+2 || sb->nlog > NLOG)
+    panic("initlog: bad log size");
+  if (sb->size > MAXBITMAP*BPB)
+    panic("initlog: file system too big");
 
   initlock(&log.lock, "log");
+  initsleeplock(&log.discarding, "discarding");
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.nfreed = (sb->size + 7) / 8;
+  log.logdev = sb->logdev ? sb->logdev : dev;
+  if (sb->logstart + sb->nlog > bdevsize(log.logdev))
+    panic("initlog: log larger than its device");
+  for (int i = 0; i < NLOG; i++) {
+    initsleeplock(&log.buf[i].lock, "logbuf");
+    log.buf[i].dev = dev;
+    log.buf[i].data = log.data[i];
+  }
+  crcinit();
   recover_from_log();
+  kthread(checkpointer, "checkpoint");
+  kthread(committer, "commit");
+}
+
+// Where the transaction after one of n blocks at position p
+// goes: right after it, unless a full transaction wouldn't fit
+// there before the end of the log.
+static uint
+next(uint p, int n)
+{
+  p += 1 + n;
+  if (p + 1 + LOGSIZE > log.size - 1)
+    p = 0;
+  return p;
+}
+
+// Is there room at log.head for a transaction of n blocks?
+// Caller holds log.lock.
+static int
+fits(int n)
+{
+  if (log.tailseq == log.seq)   // no committed transactions
+    return 1;
+  if (log.tail < log.head)
+    return 1;   // the end of the log is free
+  return log.tail > log.head && log.head + 1 + n <= log.tail;
+}
+
+// How much of the log, past its super block, committed
+// transactions take up, counting space skipped at the end.
+// Caller holds log.lock.
+static int
+used(void)
+{
+  if (log.tailseq > log.done)
+    return 0;
+  if (log.head > log.tail)
+    return log.head - log.tail;
+  return log.size - 1 - log.tail + log.head;
 }
 
-// Copy committed blocks from log to their home location
 static void
-install_trans(int recovering)
+write_super(uint tail, int seq)
 {
-  int tail;
+  struct logsuper *ls = (struct logsuper *) (log.data[0]);
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+  ls->tail = tail;
+  ls->seq = seq;
+  bwriten(log.logdev, log.start, log.data[0], 1, IO_LOG);
+  bflush(log.logdev);
 }
 
-// Read the log header from disk into the in-memory log header
+// Install the committed transactions, tailseq..done as of the
+// call, from the copy of the log in log.data, newest first, so
+// that each block is written once, with its last contents. Then
+// free their log space. Only the checkpoint thread, and recovery
+// before it starts, call this; commits may go on meanwhile.
 static void
-read_head(void)
+checkpoint(int recovering)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  static int blocks[NLOG], started[NLOG];  // too big for the stack
+  int nblocks, nstarted, i, j, seq;
+  int first, last;
+  struct trans *t;
+  struct logheader *lh;
+  uint tail;
+
+  acquire(&log.lock);
+  first = log.tailseq;
+  last = log.done;
+  release(&log.lock);
+  if (first > last)
+    return;
+
+  nblocks = nstarted = 0;
+  for (seq = last; seq >= first; seq--) {
+    t = &log.rec[seq % NLOGREC];
+    lh = (struct logheader *) (log.data[1+t->pos]);
+    for (i = lh->n - 1; i >= 0; i--) {
+      for (j = 0; j < nblocks; j++)
+        if (blocks[j] == lh->block[i])
+          break;
+      if (j < nblocks)
+        continue;   // a later transaction has it
+      blocks[nblocks++] = lh->block[i];
+      struct buf *b = &log.buf[1+t->pos+1+i];
+      acquiresleep(&b->lock);
+      b->blockno = lh->block[i];
+      b->class = recovering ? IO_META : log.pin[1+t->pos+1+i]->class;
+      bawrite(b);  // start writing dst to disk
+      started[nstarted++] = 1+t->pos+1+i;
+    }
   }
-  brelse(buf);
+  for (i = 0; i < nstarted; i++) {
+    bwait(&log.buf[started[i]]);
+    releasesleep(&log.buf[started[i]].lock);
+  }
+  bflush(log.dev);
+
+  for (seq = first; seq <= last; seq++) {
+    t = &log.rec[seq % NLOGREC];
+    lh = (struct logheader *) (log.data[1+t->pos]);
+    if (!recovering) {
+      for (i = 0; i < lh->n; i++)
+        bunpin(log.pin[1+t->pos+1+i]);  // the cache may let it go now
+    }
+    discard_trans(t);  // freed blocks are now free for good
+  }
+
+  // the transaction after last starts where last ends. the
+  // super block must say so before its space is reused, or
+  // recovery could start at a transaction written over.
+  tail = next(t->pos, lh->n);
+  write_super(tail, last + 1);
+  acquire(&log.lock);
+  log.tail = tail;
+  log.tailseq = last + 1;
+  wakeup(&log);  // commit() may be waiting for room
+  release(&log.lock);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// The checkpoint kernel thread: install committed transactions
+// when commit() asks for it.
 static void
-write_head(void)
+checkpointer(void)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  acquire(&log.lock);
+  for (;;) {
+    while (!log.install)
+      sleep(&log.install, &log.lock);
+    log.install = 0;
+    release(&log.lock);
+    checkpoint(0);
+    acquire(&log.lock);
   }
-  bwrite(buf);
+}
+
+// Read the transaction of number seq at position p, if it's
+// there, into log.data, and return the number of blocks in it,
+// or -1 if it isn't intact.
+static int
+read_trans(uint p, int seq)
+{
+  struct buf *buf;
+  struct logheader *lh = (struct logheader *) (log.data[1+p]);
+  uint crc;
+  int i;
+
+  buf = breadclass(log.logdev, log.start+1+p, IO_LOG);
+  memmove(log.data[1+p], buf->data, BSIZE);
   brelse(buf);
+  if (lh->magic != LOGMAGIC || lh->seq != seq ||
+     lh->n < 1 || lh->n > LOGSIZE || p + 1 + lh->n > log.size - 1)
+    return -1;
+  for (i = 0; i < lh->n; i++) {
+    buf = breadclass(log.logdev, log.start+1+p+1+i, IO_LOG);
+    memmove(log.data[1+p+1+i], buf->data, BSIZE);
+    brelse(buf);
+  }
+  crc = lh->crc;
+  lh->crc = 0;
+  if (crc32c(log.data[1+p], (1 + lh->n) * BSIZE) != crc)
+    return -1;
+  lh->crc = crc;
+  return lh->n;
 }
 
+// Replay the committed transactions in the log. Only recovery
+// reads the log; commits write it without going through the
+// cache.
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct buf *buf;
+  struct logsuper *ls;
+  uint p;
+  int n, seq;
+
+  buf = breadclass(log.logdev, log.start, IO_LOG);
+  ls = (struct logsuper *) (buf->data);
+  log.tail = ls->tail;
+  log.tailseq = ls->seq;
+  brelse(buf);
+  if (log.tail + 1 + LOGSIZE > log.size - 1)
+    panic("recover_from_log: bad log super block");
+
+  p = log.tail;
+  for (seq = log.tailseq; seq - log.tailseq < NLOGREC; seq++) {
+    if ((n = read_trans(p, seq)) < 0)
+      break;
+    log.rec[seq % NLOGREC].pos = p;
+    log.rec[seq % NLOGREC].ndiscard = 0;
+    p = next(p, n);
+  }
+  log.head = p;
+  log.seq = seq;
+  log.done = seq - 1;
+  checkpoint(1);  // if committed, copy from log to disk
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call that
+// may log up to n blocks.
 void
-begin_op(void)
+begin_op(int n)
 {
+  if(n < 1 || n > MAXOPBLOCKS)
+    panic("begin_op");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
-      sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
-      sleep(&log, &log.lock);
+    if(log.closed){
+      // a closed transaction whose calls have all ended is
+      // committed by whoever gets to it first; in delayed mode
+      // no end_op() may be waiting for it.
+      if(log.outstanding == 0 && log.cur.lh.n > 0 && !log.committing)
+        commit();
+      else
+        sleep(&log, &log.lock);
+    } else if(log.cur.lh.n + log.reserved + n > LOGSIZE ||
+              (!log.delayed && log.cur.lh.n > 0 &&
+               ticks - log.opened >= COMMITTICKS)){
+      // this op might exhaust log space, or the transaction
+      // has been open long enough; close it, and wait for it
+      // to commit.
+      log.closed = 1;
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      myproc()->logblocks = n;
       release(&log.lock);
       break;
     }
@@ -142,63 +463,221 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// waits until the call's updates, if any, are durable,
+// committing them if no one else will.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  int seq;
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+  if(log.outstanding < 0)
+    panic("end_op");
+  log.reserved -= myproc()->logblocks;
+  myproc()->logblocks = 0;
+  // begin_op() may be waiting for log space, and
+  // this call's unused reservation is free again.
+  // an earlier call may be waiting to commit.
+  wakeup(&log);
+
+  if(log.cur.lh.n == 0){
+    // neither this call nor any other in its transaction
+    // has logged a block, so there's nothing to wait for,
+    // and nothing to commit if begin_op() closed it.
+    if(log.outstanding == 0)
+      log.closed = 0;
+    release(&log.lock);
+    return;
   }
-  release(&log.lock);
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+  if(log.delayed){
+    // the commit thread, or a later call, commits it.
+    // if begin_op() closed it, this call may be the last.
+    if(log.closed && log.outstanding == 0 && !log.committing)
+      commit();
     release(&log.lock);
+    return;
+  }
+
+  seq = log.seq;
+  while(log.done < seq){
+    if(log.seq == seq && log.outstanding == 0 && !log.committing)
+      commit();
+    else
+      sleep(&log, &log.lock);
+  }
+  release(&log.lock);
+}
+
+// The number of the open transaction, which a caller
+// inside an FS system call is part of.
+int
+log_seq(void)
+{
+  int seq;
+
+  acquire(&log.lock);
+  seq = log.seq;
+  release(&log.lock);
+  return seq;
+}
+
+// Wait until transaction seq, and every one before it, is
+// durable, closing it and committing it if it's still open.
+void
+log_force(int seq)
+{
+  acquire(&log.lock);
+  if(seq == log.seq && log.cur.lh.n == 0)
+    seq--;  // nothing in it to commit
+  while(log.done < seq){
+    if(log.seq == seq){
+      log.closed = 1;
+      if(log.outstanding == 0 && !log.committing){
+        commit();
+        continue;
+      }
+    }
+    sleep(&log, &log.lock);
+  }
+  release(&log.lock);
+}
+
+// Switch to commit mode LOG_SYNC or LOG_DELAYED, or not if
+// mode is -1, and return the previous mode. Updates delayed so
+// far are durable when the switch to LOG_SYNC returns.
+int
+log_mode(int mode)
+{
+  int old, seq;
+
+  acquire(&log.lock);
+  old = log.delayed ? LOG_DELAYED : LOG_SYNC;
+  if(mode != -1)
+    log.delayed = mode == LOG_DELAYED;
+  seq = log.seq;
+  wakeup(&log.delayed);
+  release(&log.lock);
+  if(old == LOG_DELAYED && mode == LOG_SYNC)
+    log_force(seq);
+  return old;
+}
+
+// The commit kernel thread: in delayed mode, commit the open
+// transaction once it's COMMITDELAY ticks old.
+static void
+committer(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    if(!log.delayed || log.cur.lh.n == 0){
+      sleep(&log.delayed, &log.lock);  // log_write() or log_mode() wakes it
+    } else if(!log.closed && ticks - log.opened < COMMITDELAY){
+      sleep(&ticks, &log.lock);
+    } else {
+      log.closed = 1;
+      if(log.outstanding == 0 && !log.committing)
+        commit();
+      else
+        sleep(&log, &log.lock);
+    }
   }
 }
 
-// Copy modified blocks from cache to log.
+// Tell the device about the blocks an installed transaction freed.
 static void
-write_log(void)
+discard_trans(struct trans *t)
 {
-  int tail;
+  struct { uint start; uint n; } run[NDISCARD];
+  int i, n;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  // log_undiscard() may be changing t's runs, and waits
+  // until they are discarded before a block in them is
+  // reused and written.
+  acquiresleep(&log.discarding);
+  acquire(&log.lock);
+  n = t->ndiscard;
+  for (i = 0; i < n; i++) {
+    run[i].start = t->discard[i].start;
+    run[i].n = t->discard[i].n;
   }
+  t->ndiscard = 0;
+  release(&log.lock);
+
+  for (i = 0; i < n; i++)
+    bdiscard(log.dev, run[i].start, run[i].n);
+  releasesleep(&log.discarding);
 }
 
+// Commit the open transaction, which has no sys calls left.
+// Called and returns with log.lock held, but releases it while
+// writing, and opens the next transaction as soon as the closed
+// one's blocks have been copied aside.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  struct trans *t;
+  struct logheader *lh;
+  int i, n, seq;
+  uint p;
+
+  seq = log.seq;
+  log.committing = 1;
+  log.closed = 1;  // no new sys calls while copying
+  t = &log.rec[seq % NLOGREC];
+  *t = log.cur;
+  n = t->lh.n;
+  while (!fits(n)) {
+    log.install = 1;
+    wakeup(&log.install);
+    sleep(&log, &log.lock);
+  }
+  p = t->pos = log.head;
+  release(&log.lock);
+
+  for (i = 0; i < n; i++) {
+    struct buf *b = bread(log.dev, t->lh.block[i]); // pinned, so cached
+    memmove(log.data[1+p+1+i], b->data, BSIZE);
+    log.pin[1+p+1+i] = b;  // stays pinned until installed
+    brelse(b);
+  }
+  lh = (struct logheader *) (log.data[1+p]);
+  memset(lh, 0, BSIZE);
+  lh->magic = LOGMAGIC;
+  lh->seq = seq;
+  lh->n = n;
+  for (i = 0; i < n; i++)
+    lh->block[i] = t->lh.block[i];
+  lh->crc = crc32c(log.data[1+p], (1 + n) * BSIZE);
+
+  acquire(&log.lock);
+  log.cur.lh.n = 0;
+  log.cur.ndiscard = 0;
+  log.cur.ordered = 0;
+  log.seq++;
+  log.closed = 0;
+  wakeup(&log);
+  release(&log.lock);
+
+  // the data blocks its calls wrote home must be durable
+  // before the transaction says where they are.
+  if (t->ordered)
+    bflush(log.dev);
+
+  // write the header and the blocks -- the real commit.
+  bwriten(log.logdev, log.start+1+p, log.data[1+p], 1 + n, IO_LOG);
+  bflush(log.logdev);
+
+  acquire(&log.lock);
+  log.head = next(p, n);
+  memset(log.freed[seq % 2], 0, log.nfreed);
+  log.committing = 0;
+  log.done = seq;
+  wakeup(&log);
+  if (used() > (log.size - 1) / 2) {
+    log.install = 1;
+    wakeup(&log.install);
   }
 }
 
@@ -217,20 +696,144 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
+  for (i = 0; i < log.cur.lh.n; i++) {
+    if (log.cur.lh.block[i] == b->blockno)   // log absorption
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  if (i == log.cur.lh.n) {  // Add new block to log?
+    if (log.cur.lh.n >= LOGSIZE)
+      panic("too big a transaction");
+    if (myproc()->logblocks < 1)
+      panic("log_write: op over its reservation");
+    myproc()->logblocks--;
+    log.reserved--;
+    log.cur.lh.block[i] = b->blockno;
     bpin(b);
-    log.lh.n++;
+    if (log.cur.lh.n == 0) {
+      log.opened = ticks;
+      if (log.delayed)
+        wakeup(&log.delayed);  // start the commit thread's clock
+    }
+    log.cur.lh.n++;
   }
   release(&log.lock);
 }
 
+
+// Block b has been freed by the current transaction;
+// discard it once the transaction commits.
+void
+log_discard(uint b)
+{
+  int i;
+
+  acquire(&log.lock);
+  if (log.outstanding < 1)
+    panic("log_discard outside of trans");
+  log.freed[log.seq % 2][b/8] |= 1 << (b % 8);
+  for (i = 0; i < log.cur.ndiscard; i++) {
+    if (log.cur.discard[i].start + log.cur.discard[i].n == b) {
+      log.cur.discard[i].n++;
+      break;
+    }
+    if (b + 1 == log.cur.discard[i].start) {
+      log.cur.discard[i].start--;
+      log.cur.discard[i].n++;
+      break;
+    }
+  }
+  if (i == log.cur.ndiscard && log.cur.ndiscard < NDISCARD) {
+    log.cur.discard[i].start = b;
+    log.cur.discard[i].n = 1;
+    log.cur.ndiscard++;
+  }
+  release(&log.lock);
+}
+
+// Remove block b from t's runs of freed blocks.
+// Caller holds log.lock.
+static void
+undiscard(struct trans *t, uint b)
+{
+  int i;
+  uint start, end;
+
+  for (i = 0; i < t->ndiscard; i++) {
+    start = t->discard[i].start;
+    end = start + t->discard[i].n;
+    if (b < start || b >= end)
+      continue;
+    if (b == start) {
+      t->discard[i].start++;
+      t->discard[i].n--;
+    } else {
+      // keep the part below b, and the part above b if there's room.
+      t->discard[i].n = b - start;
+      if (b + 1 < end && t->ndiscard < NDISCARD) {
+        t->discard[t->ndiscard].start = b + 1;
+        t->discard[t->ndiscard].n = end - (b + 1);
+        t->ndiscard++;
+      }
+    }
+    if (t->discard[i].n == 0)
+      t->discard[i] = t->discard[--t->ndiscard];
+    break;
+  }
+}
+
+// Block b, maybe freed earlier by this transaction or one
+// not yet installed, has been allocated again; it must not
+// be discarded.
+void
+log_undiscard(uint b)
+{
+  int seq;
+
+  acquiresleep(&log.discarding);
+  acquire(&log.lock);
+  undiscard(&log.cur, b);
+  for (seq = log.tailseq; seq < log.seq; seq++)
+    undiscard(&log.rec[seq % NLOGREC], b);
+  release(&log.lock);
+  releasesleep(&log.discarding);
+}
+
+// Is block b, free in the bitmap, still unfit to allocate?
+// It is if a transaction that isn't durable yet freed it,
+// or if the log holds a copy of it that's not installed;
+// a crash, or checkpoint(), could overwrite the data a new
+// owner writes straight home.
+int
+log_inuse(uint b)
+{
+  struct logheader *lh;
+  int i, seq, r;
+
+  acquire(&log.lock);
+  r = (log.freed[0][b/8] | log.freed[1][b/8]) & (1 << (b % 8));
+  for (i = 0; !r && i < log.cur.lh.n; i++)
+    r = log.cur.lh.block[i] == b;
+  for (seq = log.tailseq; !r && seq < log.seq; seq++) {
+    lh = &log.rec[seq % NLOGREC].lh;
+    for (i = 0; !r && i < lh->n; i++)
+      r = lh->block[i] == b;
+  }
+  release(&log.lock);
+  return r != 0;
+}
+
+// The caller has written data blocks of the open transaction
+// straight home, and waited for the writes; commit() must
+// flush them before writing the transaction.
+void
+log_ordered(void)
+{
+  acquire(&log.lock);
+  if (log.outstanding < 1)
+    panic("log_ordered outside of trans");
+  log.cur.ordered = 1;
+  release(&log.lock);
+}
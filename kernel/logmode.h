@@ -0,0 +1,4 @@
+// Commit modes of the log, for the logmode() system call.
+
+#define LOG_SYNC     0  // FS calls return once their updates are durable
+#define LOG_DELAYED  1  // commit every COMMITDELAY ticks, or on fsync()
@@ -7,9 +7,10 @@
 // 02000000 -- CLINT
 // 0C000000 -- PLIC
 // 10000000 -- uart0 
-// 10001000 -- virtio disk 
+// 10001000 -- virtio disks, one page each
 // 80000000 -- boot ROM jumps here in machine mode
 //             -kernel loads the kernel here
+// 84000000 -- -initrd loads the disk image here, if any
 // unused RAM after 80000000.
 
 // the kernel uses physical memory thus:
@@ -21,9 +22,12 @@
 #define UART0 0x10000000L
 #define UART0_IRQ 10
 
-// virtio mmio interface
+// virtio mmio interface: NVIRTIO slots, a page apart,
+// with consecutive IRQs.
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
+#define NVIRTIO 8
+#define VIRTIO(n) (VIRTIO0 + (n)*0x1000)
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
@@ -44,6 +48,9 @@
 #define KERNBASE 0x80000000L
 #define PHYSTOP (KERNBASE + 128*1024*1024)
 
+// qemu -initrd loads a RAM disk image halfway into RAM.
+#define RAMDISK (KERNBASE + 64*1024*1024)
+
 // map the trampoline page to the highest address,
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
@@ -2,12 +2,40 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE      100  // maximum number of in-memory i-nodes
+#define NDENTRY      128  // directory name cache entries
 #define NDEV         10  // maximum major device number
+#define NBDEV         4  // maximum block device number
+#define NVDISK        4  // maximum number of virtio disks
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define MAXOPBLOCKS  40  // max # of blocks any FS op writes
+// blocks each kind of FS op reserves in begin_op(). k block
+// allocations touch at most BMAPOPBLOCKS(k) bitmap blocks.
+// nbitmap is the number the file system has (see fsinit()).
+#define BMAPOPBLOCKS(k)  ((k) < nbitmap ? (k) : nbitmap)
+#define IPUTOPBLOCKS     (1+nbitmap)  // inode; bitmap if it's freed
+#define DIRLINKOPBLOCKS  (4+2*NINDLEVEL+BMAPOPBLOCKS(2+NINDLEVEL))  // 3 dir blocks, inode, indirect blocks
+#define LINKOPBLOCKS     (1+DIRLINKOPBLOCKS+IPUTOPBLOCKS)
+#define UNLINKOPBLOCKS   (3+2*IPUTOPBLOCKS)
+#define TRIMOPBLOCKS     (1+NINDLEVEL+nbitmap)  // inode, indirect blocks, bitmap
+#define CREATEOPBLOCKS   (2+DIRLINKOPBLOCKS+BMAPOPBLOCKS(1)+IPUTOPBLOCKS)
+// n data blocks, not logged; the inode, and an indirect block
+// changed and one added at each level (or an extent block;
+// MAXEXTDEPTH is no more than NINDLEVEL).
+#define WRITEOPBLOCKS(n) (1+2*NINDLEVEL+BMAPOPBLOCKS((n)+2*NINDLEVEL))
+// the most bitmap blocks a file system can have: enough that
+// UNLINKOPBLOCKS, and TRIMOPBLOCKS+IPUTOPBLOCKS, fit in
+// MAXOPBLOCKS.
+#define MAXBITMAP        ((MAXOPBLOCKS-5)/2)
+#define LOGSIZE      (MAXOPBLOCKS*3)  // max blocks logged by a transaction
+#define NLOG         (1+3*(LOGSIZE+1))  // blocks in on-disk log
+#define NLOGREC      (NLOG/2)  // max transactions in on-disk log
+#define NBUF         (NLOG+LOGSIZE*2)  // size of disk block cache
+#define COMMITTICKS  1   // max ticks a transaction stays open to new ops
+#define COMMITDELAY  50  // ticks before a delayed-mode transaction commits
+#define NDISCARD     16  // max runs of freed blocks discarded per commit
+#define NWRITEI      8   // max data block writes writei() keeps in flight
+#define WRITEOPMAX   64  // max data blocks a write op covers
+#define MAXINODES    (1<<18)  // max inodes in a file system
 #define MAXPATH      128   // maximum file path name
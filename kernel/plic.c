@@ -13,7 +13,8 @@ plicinit(void)
 {
   // set desired IRQ priorities non-zero (otherwise disabled).
   *(uint32*)(PLIC + UART0_IRQ*4) = 1;
-  *(uint32*)(PLIC + VIRTIO0_IRQ*4) = 1;
+  for(int i = 0; i < NVIRTIO; i++)
+    *(uint32*)(PLIC + (VIRTIO0_IRQ+i)*4) = 1;
 }
 
 void
@@ -22,8 +23,9 @@ plicinithart(void)
   int hart = cpuid();
   
   // set enable bits for this hart's S-mode
-  // for the uart and virtio disk.
-  *(uint32*)PLIC_SENABLE(hart) = (1 << UART0_IRQ) | (1 << VIRTIO0_IRQ);
+  // for the uart and virtio disks.
+  *(uint32*)PLIC_SENABLE(hart) = (1 << UART0_IRQ) |
+    (((1 << NVIRTIO) - 1) << VIRTIO0_IRQ);
 
   // set this hart's S-mode priority threshold to 0.
   *(uint32*)PLIC_SPRIORITY(hart) = 0;
@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fs.h"
 
 struct cpu cpus[NCPU];
 
@@ -168,6 +169,7 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfunc = 0;
   p->state = UNUSED;
 }
 
@@ -254,6 +256,34 @@ userinit(void)
   release(&p->lock);
 }
 
+// A kernel thread's first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  myproc()->kfunc();
+  panic("kthread returned");
+}
+
+// Start a process that runs fn in the kernel, and never
+// returns to user space or exits.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfunc = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -360,7 +390,7 @@ exit(int status)
     }
   }
 
-  begin_op();
+  begin_op(IPUTOPBLOCKS);
   iput(p->cwd);
   end_op();
   p->cwd = 0;
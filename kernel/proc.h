@@ -104,4 +104,6 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  int logblocks;               // log space left in this FS op (log.c)
+  void (*kfunc)(void);         // body of a kernel thread, else 0
 };
@@ -1,6 +1,10 @@
 //
 // ramdisk that uses the disk image loaded by qemu -initrd fs.img
 //
+// qemu -machine virt puts the image halfway into RAM (for
+// less than 256MB of RAM), at RAMDISK. kinit() leaves those
+// pages alone if ramdisksize() finds a file system there.
+//
 
 #include "types.h"
 #include "riscv.h"
@@ -11,35 +15,96 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "bdev.h"
+
+static uint nblocks;
+
+static struct bdevsw ramdisk_bdevsw;
+
+// Size in bytes of the file system image at RAMDISK,
+// or 0 if qemu didn't load one.
+uint64
+ramdisksize(void)
+{
+  struct superblock *sb = (struct superblock *)(RAMDISK + BSIZE);
+
+  if(sb->magic != FSMAGIC)
+    return 0;
+  if(RAMDISK + (uint64)sb->size * BSIZE > PHYSTOP)
+    panic("ramdisk: image too big");
+  return (uint64)sb->size * BSIZE;
+}
 
 void
 ramdiskinit(void)
 {
+  uint64 size = ramdisksize();
+
+  if(size == 0)
+    return;
+  nblocks = size / BSIZE;
+  printf("ramdisk: %d blocks at %p\n", nblocks, RAMDISK);
+  bdevattach(&ramdisk_bdevsw, 0);
 }
 
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
-void
-ramdiskrw(struct buf *b)
+// Copy between b->data and the image. The copy is the whole
+// request, so b->disk is never set and there is nothing to
+// wait for or flush.
+static void
+ramdiskstart(int unit, struct buf *b, uint blockno, int write)
 {
   if(!holdingsleep(&b->lock))
-    panic("ramdiskrw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("ramdiskrw: nothing to do");
-
-  if(b->blockno >= FSSIZE)
-    panic("ramdiskrw: blockno too big");
+    panic("ramdisk: buf not locked");
+  if(blockno >= nblocks)
+    panic("ramdisk: blockno too big");
 
-  uint64 diskaddr = b->blockno * BSIZE;
+  uint64 diskaddr = (uint64)blockno * BSIZE;
   char *addr = (char *)RAMDISK + diskaddr;
 
-  if(b->flags & B_DIRTY){
-    // write
+  if(write)
     memmove(addr, b->data, BSIZE);
-    b->flags &= ~B_DIRTY;
-  } else {
-    // read
+  else
     memmove(b->data, addr, BSIZE);
-    b->flags |= B_VALID;
-  }
 }
+
+static void
+ramdiskwait(int unit, struct buf *b, uint blockno)
+{
+}
+
+static void
+ramdiskwriten(int unit, uint blockno, void *data, uint n, int class)
+{
+  if(blockno + n > nblocks)
+    panic("ramdisk: blockno too big");
+  memmove((char *)RAMDISK + (uint64)blockno * BSIZE, data, n * BSIZE);
+}
+
+static void
+ramdiskflush(int unit)
+{
+}
+
+// Zero discarded blocks, so stale data can't leak back.
+static void
+ramdiskdiscard(int unit, uint blockno, uint n)
+{
+  if(blockno + n > nblocks)
+    panic("ramdisk: discard too big");
+  memset((char *)RAMDISK + (uint64)blockno * BSIZE, 0, n * BSIZE);
+}
+
+static uint
+ramdisknblocks(int unit)
+{
+  return nblocks;
+}
+
+static struct bdevsw ramdisk_bdevsw = {
+  .start = ramdiskstart,
+  .wait = ramdiskwait,
+  .writen = ramdiskwriten,
+  .flush = ramdiskflush,
+  .discard = ramdiskdiscard,
+  .size = ramdisknblocks,
+};
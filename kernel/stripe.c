@@ -0,0 +1,178 @@
+//
+// striped (RAID-0) block device over several disks.
+//
+// mkfs -d ndisks -s stripe fs.img ... splits the file system
+// image into member images, each starting with a struct
+// disklabel (see fs.h). a driver that finds labelled disks
+// hands them to stripeadd(), and stripeattach() then presents
+// the whole set as one block device. consecutive stripe units
+// live on different members, so the parallel writes of a log
+// commit, and concurrent readers, keep all the disks busy.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "bdev.h"
+
+static struct {
+  int ndisks;
+  uint stripe;       // blocks per stripe unit
+  uint size;         // blocks in the set
+  struct {
+    struct bdevsw *sw;   // 0 if not found (yet)
+    int unit;
+  } member[NVDISK];
+} set;
+
+static struct bdevsw stripe_bdevsw;
+
+// Take note of a disk carrying label.
+void
+stripeadd(struct bdevsw *sw, int unit, struct disklabel *label)
+{
+  if(set.ndisks == 0){
+    if(label->ndisks < 1 || label->ndisks > NVDISK || label->stripe == 0)
+      panic("stripe: bad label");
+    set.ndisks = label->ndisks;
+    set.stripe = label->stripe;
+  }
+  if(label->ndisks != set.ndisks || label->stripe != set.stripe ||
+     label->index >= set.ndisks)
+    panic("stripe: disks from different sets");
+  if(set.member[label->index].sw)
+    panic("stripe: duplicate member");
+  set.member[label->index].sw = sw;
+  set.member[label->index].unit = unit;
+}
+
+// Attach the set as a block device, once all the
+// members have been added.
+void
+stripeattach(void)
+{
+  uint units = 0;
+  int i;
+
+  if(set.ndisks == 0)
+    return;
+
+  for(i = 0; i < set.ndisks; i++){
+    if(set.member[i].sw == 0)
+      panic("stripe: member missing");
+    // a member holds its label and then whole stripe units.
+    uint n = (set.member[i].sw->size(set.member[i].unit) - 1) / set.stripe;
+    if(i == 0 || n < units)
+      units = n;
+  }
+  set.size = units * set.stripe * set.ndisks;
+
+  printf("stripe: %d disks, %d blocks per unit\n", set.ndisks, set.stripe);
+  bdevattach(&stripe_bdevsw, 0);
+}
+
+// Find the member disk, and the block on it, that hold
+// block blockno of the set.
+static int
+map(uint blockno, uint *mblockno)
+{
+  uint unit = blockno / set.stripe;
+
+  if(blockno >= set.size)
+    panic("stripe: blockno too big");
+  *mblockno = 1 + (unit / set.ndisks) * set.stripe + blockno % set.stripe;
+  return unit % set.ndisks;
+}
+
+static void
+stripestart(int unit, struct buf *b, uint blockno, int write)
+{
+  uint mblockno;
+  int i = map(blockno, &mblockno);
+
+  set.member[i].sw->start(set.member[i].unit, b, mblockno, write);
+}
+
+static void
+stripewait(int unit, struct buf *b, uint blockno)
+{
+  uint mblockno;
+  int i = map(blockno, &mblockno);
+
+  set.member[i].sw->wait(set.member[i].unit, b, mblockno);
+}
+
+// A run of set blocks is contiguous on a member only within
+// a stripe unit, so write it a unit at a time.
+static void
+stripewriten(int unit, uint blockno, void *data, uint n, int class)
+{
+  uint mblockno, m;
+  int i;
+
+  for(; n > 0; blockno += m, n -= m, data = (char *)data + m * BSIZE){
+    m = set.stripe - blockno % set.stripe;
+    if(m > n)
+      m = n;
+    i = map(blockno, &mblockno);
+    set.member[i].sw->writen(set.member[i].unit, mblockno, data, m, class);
+  }
+}
+
+static void
+stripeflush(int unit)
+{
+  for(int i = 0; i < set.ndisks; i++)
+    set.member[i].sw->flush(set.member[i].unit);
+}
+
+// A member's share of a run of set blocks is the tail of one
+// unit, some whole units and the head of another, which are
+// adjacent on the member, so each member gets one discard.
+static void
+stripediscard(int unit, uint blockno, uint n)
+{
+  uint end = blockno + n;
+  uint first, last, mfirst, mlast;
+  int i, j;
+
+  if(n == 0)
+    return;
+  for(i = 0; i < set.ndisks; i++){
+    // the first and last units of the run on member i.
+    uint u0 = blockno / set.stripe;
+    uint u1 = (end - 1) / set.stripe;
+    u0 += (i - u0 % set.ndisks + set.ndisks) % set.ndisks;
+    u1 -= (u1 % set.ndisks - i + set.ndisks) % set.ndisks;
+    if(u1 / set.ndisks < u0 / set.ndisks || u1 > (end - 1) / set.stripe)
+      continue;
+    first = u0 * set.stripe > blockno ? u0 * set.stripe : blockno;
+    last = u1 * set.stripe + set.stripe - 1 < end - 1 ?
+      u1 * set.stripe + set.stripe - 1 : end - 1;
+    if(first > last)
+      continue;
+    j = map(first, &mfirst);
+    map(last, &mlast);
+    set.member[j].sw->discard(set.member[j].unit, mfirst, mlast - mfirst + 1);
+  }
+}
+
+static uint
+stripesize(int unit)
+{
+  return set.size;
+}
+
+static struct bdevsw stripe_bdevsw = {
+  .start = stripestart,
+  .wait = stripewait,
+  .writen = stripewriten,
+  .flush = stripeflush,
+  .discard = stripediscard,
+  .size = stripesize,
+};
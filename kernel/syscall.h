@@ -20,3 +20,9 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_diskstat 22
+#define SYS_fsync  23
+#define SYS_fdatasync 24
+#define SYS_logmode 25
+#define SYS_fsstat 26
+#define SYS_fallocate 27
@@ -15,6 +15,9 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "diskstat.h"
+#include "fsstat.h"
+#include "logmode.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -94,6 +97,20 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// reserve disk blocks for a file's contents up to a length.
+uint64
+sys_fallocate(void)
+{
+  struct file *f;
+  int len;
+
+  argint(1, &len);
+  if(argfd(0, 0, &f) < 0 || len < 0)
+    return -1;
+
+  return fileallocate(f, len);
+}
+
 uint64
 sys_close(void)
 {
@@ -119,6 +136,38 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// Wait until the updates to fd's file are durable, committing
+// the open transaction if it has some. With data set, only
+// updates to its contents or size count.
+static int
+syncfd(int data)
+{
+  struct file *f;
+  int seq;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type != FD_INODE && f->type != FD_DEVICE)
+    return -1;
+  ilock(f->ip);
+  seq = data ? f->ip->dataseq : f->ip->logseq;
+  iunlock(f->ip);
+  log_force(seq);
+  return 0;
+}
+
+uint64
+sys_fsync(void)
+{
+  return syncfd(0);
+}
+
+uint64
+sys_fdatasync(void)
+{
+  return syncfd(1);
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -129,7 +178,7 @@ sys_link(void)
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op(LINKOPBLOCKS);
   if((ip = namei(old)) == 0){
     end_op();
     return -1;
@@ -196,7 +245,7 @@ sys_unlink(void)
   if(argstr(0, path, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op(UNLINKOPBLOCKS);
   if((dp = nameiparent(path, name)) == 0){
     end_op();
     return -1;
@@ -222,6 +271,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dirforget(dp, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -262,7 +312,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0){
+  if((ip = ialloc(dp->dev, type, dp->inum)) == 0){
     iunlockput(dp);
     return 0;
   }
@@ -272,6 +322,7 @@ create(char *path, short type, short major, short minor)
   ip->minor = minor;
   ip->nlink = 1;
   iupdate(ip);
+  iplace(ip, dp);
 
   if(type == T_DIR){  // Create . and .. entries.
     // No ip->nlink++ for ".": avoid cyclic ref count.
@@ -314,7 +365,13 @@ sys_open(void)
   if((n = argstr(0, path, MAXPATH)) < 0)
     return -1;
 
-  begin_op();
+  // a file that create() makes is empty, so O_TRUNC costs
+  // nothing more. otherwise namei() may free a directory
+  // removed meanwhile, and O_TRUNC costs as much as that again.
+  if(omode & O_CREATE)
+    begin_op(CREATEOPBLOCKS);
+  else
+    begin_op(omode & O_TRUNC ? 2*IPUTOPBLOCKS : IPUTOPBLOCKS);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -376,7 +433,7 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op();
+  begin_op(CREATEOPBLOCKS);
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -393,7 +450,7 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
+  begin_op(CREATEOPBLOCKS);
   argint(1, &major);
   argint(2, &minor);
   if((argstr(0, path, MAXPATH)) < 0 ||
@@ -413,7 +470,9 @@ sys_chdir(void)
   struct inode *ip;
   struct proc *p = myproc();
   
-  begin_op();
+  // namei() may free a directory removed meanwhile, and the
+  // iput() the old cwd, if it has been removed too.
+  begin_op(2*IPUTOPBLOCKS);
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
     end_op();
     return -1;
@@ -503,3 +562,60 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// report disk driver counters, and optionally
+// switch its completion mode (-1 leaves it alone).
+// returns the previous mode.
+uint64
+sys_diskstat(void)
+{
+  int mode, old;
+  uint64 addr; // user pointer to struct diskstat, or 0
+  struct diskstat st;
+
+  argint(0, &mode);
+  argaddr(1, &addr);
+  old = virtio_disk_stat(mode, &st);
+  if(addr != 0 && copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return old;
+}
+
+// switch the log's commit mode (-1 leaves it alone).
+// returns the previous mode.
+uint64
+sys_logmode(void)
+{
+  int mode;
+
+  argint(0, &mode);
+  if(mode != -1 && mode != LOG_SYNC && mode != LOG_DELAYED)
+    return -1;
+  return log_mode(mode);
+}
+
+// report the block allocator's counters and the free space,
+// and how fragmented file fd is, if fd isn't -1.
+uint64
+sys_fsstat(void)
+{
+  int fd;
+  uint64 addr; // user pointer to struct fsstat
+  struct file *f;
+  struct fsstat st;
+
+  argint(0, &fd);
+  argaddr(1, &addr);
+  if(fd == -1){
+    fsstat(0, &st);
+  } else {
+    if(argfd(0, 0, &f) < 0 || f->type != FD_INODE)
+      return -1;
+    ilock(f->ip);
+    fsstat(f->ip, &st);
+    iunlock(f->ip);
+  }
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
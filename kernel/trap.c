@@ -188,8 +188,8 @@ devintr()
 
     if(irq == UART0_IRQ){
       uartintr();
-    } else if(irq == VIRTIO0_IRQ){
-      virtio_disk_intr();
+    } else if(irq >= VIRTIO0_IRQ && irq < VIRTIO0_IRQ + NVIRTIO){
+      virtio_disk_intr(irq);
     } else if(irq){
       printf("unexpected interrupt irq=%d\n", irq);
     }
@@ -29,6 +29,7 @@
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
 #define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0 // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration space
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -38,6 +39,8 @@
 
 // device feature bits
 #define VIRTIO_BLK_F_RO              5	/* Disk is read-only */
+#define VIRTIO_BLK_F_FLUSH           9	/* Cache flush command support */
+#define VIRTIO_BLK_F_DISCARD        13	/* Discard command support */
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
 #define VIRTIO_BLK_F_MQ             12	/* support more than one vq */
@@ -47,7 +50,8 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+// each request uses three, so about NUM/3 can be in flight.
+#define NUM 32
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -61,11 +65,12 @@ struct virtq_desc {
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_AVAIL_F_NO_INTERRUPT or zero
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 used_event; // with EVENT_IDX: interrupt when used->idx passes this
 };
+#define VRING_AVAIL_F_NO_INTERRUPT 1 // hint: don't interrupt (no EVENT_IDX)
 
 // one entry in the "used" ring, with which the
 // device tells the driver about completed requests.
@@ -78,13 +83,22 @@ struct virtq_used {
   uint16 flags; // always zero
   uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event; // with EVENT_IDX: notify when avail->idx passes this
 };
 
+// with VIRTIO_RING_F_EVENT_IDX, the side that moved an index from
+// old to new must signal the other side only if new has passed the
+// other side's event index. from the spec, section 2.6.7.2.
+#define vring_need_event(event, new, old) \
+  ((uint16)((new) - (event) - 1) < (uint16)((new) - (old)))
+
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
 
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
+#define VIRTIO_BLK_T_FLUSH 4 // write back the device's cache
+#define VIRTIO_BLK_T_DISCARD 11 // forget the contents of some sectors
 
 // the format of the first descriptor in a disk request.
 // to be followed by two more descriptors containing
@@ -94,3 +108,15 @@ struct virtio_blk_req {
   uint32 reserved;
   uint64 sector;
 };
+
+// the data of a discard request: a list of these,
+// one per range of sectors.
+struct virtio_blk_discard {
+  uint64 sector;
+  uint32 num_sectors;
+  uint32 flags;
+};
+
+// offsets of fields in the block device's config space.
+#define VIRTIO_BLK_CFG_CAPACITY     0x00 // 64 bits, in sectors
+#define VIRTIO_BLK_CFG_MAX_DISCARD  0x24 // max sectors per discard
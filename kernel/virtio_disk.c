@@ -1,9 +1,16 @@
 //
-// driver for qemu's virtio disk device.
+// driver for qemu's virtio disk devices.
 // uses qemu's mmio interface to virtio.
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
+// more disks can sit on virtio-mmio-bus.1 and up. disks whose
+// block 0 holds a disklabel are members of a striped set, which
+// stripe.c assembles; the rest are attached as plain block devices.
+//
+// request latencies and queue depths are kept for the iostat
+// device (see iostat.h).
+//
 
 #include "types.h"
 #include "riscv.h"
@@ -14,12 +21,33 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "bdev.h"
 #include "virtio.h"
+#include "diskstat.h"
+#include "file.h"
+#include "iostat.h"
+
+// a block is BSIZE/512 of the disk's sectors.
+#if BSIZE % 512 != 0
+#error "BSIZE must be a multiple of the 512-byte sector"
+#endif
+
+// the address of virtio mmio register r of disk dk.
+#define R(dk, r) ((volatile uint32 *)((dk)->base + (r)))
+
+// the device's current used ring index. the device writes
+// it behind the compiler's back, so always re-read it.
+#define USED_IDX(dk) (*(volatile uint16 *)&(dk)->used->idx)
 
-// the address of virtio mmio register r.
-#define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
+// in DISK_MODE_POLL, how long to spin on the used ring
+// before giving up and sleeping, in time CSR ticks
+// (qemu's timebase is 10 MHz, so about 50 microseconds).
+#define POLLTICKS 500
 
 static struct disk {
+  uint64 base;     // address of the mmio registers
+  int irq;
+
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
   // disk operations. there are NUM descriptors.
@@ -46,119 +74,185 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    int *done;   // set to 0, and woken up, when the request finishes
     char status;
+    char write;  // for iostat
+    int class;   // IO_META etc., or -1 for flushes and discards
+    uint64 start; // time CSR at submit
   } info[NUM];
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
-  
+
+  // completion mode, VIRTIO_RING_F_EVENT_IDX, and counters.
+  struct diskstat st;
+
+  int inflight;      // requests submitted but not drained
+  struct iostat ios;
+
+  uint64 capacity; // in 512-byte sectors
+  uint maxdiscard; // blocks per discard request
+
+  // the one discard request in flight, if discarding.
+  struct virtio_blk_discard dseg;
+  int discarding;
+
   struct spinlock vdisk_lock;
-  
-} disk;
 
-void
-virtio_disk_init(void)
+} disk[NVDISK];
+
+static int ndisk;
+
+static struct bdevsw virtio_bdevsw;
+static void readlabel(struct disk *, struct disklabel *);
+static int iostatread(int, uint64, int);
+static int iostatwrite(int, uint64, int);
+
+// set up the virtio disk whose registers are at dk->base.
+static void
+setup(struct disk *dk)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
+  initlock(&dk->vdisk_lock, "virtio_disk");
 
-  if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
-     *R(VIRTIO_MMIO_VERSION) != 2 ||
-     *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
-     *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
-    panic("could not find virtio disk");
-  }
-  
   // reset device
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(dk, VIRTIO_MMIO_STATUS) = status;
 
   // set ACKNOWLEDGE status bit
   status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(dk, VIRTIO_MMIO_STATUS) = status;
 
   // set DRIVER status bit
   status |= VIRTIO_CONFIG_S_DRIVER;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(dk, VIRTIO_MMIO_STATUS) = status;
 
   // negotiate features
-  uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+  uint64 features = *R(dk, VIRTIO_MMIO_DEVICE_FEATURES);
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
-  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  *R(dk, VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  dk->st.event_idx = (features & (1 << VIRTIO_RING_F_EVENT_IDX)) != 0;
+  dk->st.flush = (features & (1 << VIRTIO_BLK_F_FLUSH)) != 0;
+  dk->st.discard = (features & (1 << VIRTIO_BLK_F_DISCARD)) != 0;
+  dk->st.mode = DISK_MODE_INTR;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(dk, VIRTIO_MMIO_STATUS) = status;
 
   // re-read status to ensure FEATURES_OK is set.
-  status = *R(VIRTIO_MMIO_STATUS);
+  status = *R(dk, VIRTIO_MMIO_STATUS);
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
   // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
+  *R(dk, VIRTIO_MMIO_QUEUE_SEL) = 0;
 
   // ensure queue 0 is not in use.
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
+  if(*R(dk, VIRTIO_MMIO_QUEUE_READY))
     panic("virtio disk should not be ready");
 
   // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  uint32 max = *R(dk, VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
   if(max < NUM)
     panic("virtio disk max queue too short");
 
   // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
-  if(!disk.desc || !disk.avail || !disk.used)
+  dk->desc = kalloc();
+  dk->avail = kalloc();
+  dk->used = kalloc();
+  if(!dk->desc || !dk->avail || !dk->used)
     panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
+  memset(dk->desc, 0, PGSIZE);
+  memset(dk->avail, 0, PGSIZE);
+  memset(dk->used, 0, PGSIZE);
 
   // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(dk, VIRTIO_MMIO_QUEUE_NUM) = NUM;
 
   // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
+  *R(dk, VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)dk->desc;
+  *R(dk, VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)dk->desc >> 32;
+  *R(dk, VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)dk->avail;
+  *R(dk, VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)dk->avail >> 32;
+  *R(dk, VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)dk->used;
+  *R(dk, VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)dk->used >> 32;
 
   // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+  *R(dk, VIRTIO_MMIO_QUEUE_READY) = 0x1;
 
   // all NUM descriptors start out unused.
   for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+    dk->free[i] = 1;
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(dk, VIRTIO_MMIO_STATUS) = status;
+
+  dk->capacity = *R(dk, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_CAPACITY) |
+    (uint64)*R(dk, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4) << 32;
+  if(dk->st.discard){
+    dk->maxdiscard = *R(dk, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_MAX_DISCARD) / (BSIZE / 512);
+    if(dk->maxdiscard == 0)
+      dk->st.discard = 0;
+  }
+}
+
+void
+virtio_disk_init(void)
+{
+  struct disklabel label[NVDISK];
+  int i;
+
+  // probe the mmio slots; qemu fills in the empty
+  // ones with device ID 0.
+  for(i = 0; i < NVIRTIO && ndisk < NVDISK; i++){
+    struct disk *dk = &disk[ndisk];
+    dk->base = VIRTIO(i);
+    dk->irq = VIRTIO0_IRQ + i;
+    if(*R(dk, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
+       *R(dk, VIRTIO_MMIO_VERSION) != 2 ||
+       *R(dk, VIRTIO_MMIO_DEVICE_ID) != 2 ||
+       *R(dk, VIRTIO_MMIO_VENDOR_ID) != 0x554d4551)
+      continue;
+    setup(dk);
+    ndisk++;
+  }
+
+  // members of a striped set go to stripe.c, which attaches
+  // the set first, so that it becomes ROOTDEV.
+  for(i = 0; i < ndisk; i++){
+    readlabel(&disk[i], &label[i]);
+    if(label[i].magic == LABELMAGIC)
+      stripeadd(&virtio_bdevsw, i, &label[i]);
+  }
+  stripeattach();
+  for(i = 0; i < ndisk; i++){
+    if(label[i].magic != LABELMAGIC)
+      bdevattach(&virtio_bdevsw, i);
+  }
+
+  devsw[IOSTAT].read = iostatread;
+  devsw[IOSTAT].write = iostatwrite;
 
-  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ and up.
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct disk *dk)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(dk->free[i]){
+      dk->free[i] = 0;
       return i;
     }
   }
@@ -167,28 +261,28 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct disk *dk, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(dk->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  dk->desc[i].addr = 0;
+  dk->desc[i].len = 0;
+  dk->desc[i].flags = 0;
+  dk->desc[i].next = 0;
+  dk->free[i] = 1;
+  wakeup(&dk->free[0]);
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct disk *dk, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = dk->desc[i].flags;
+    int nxt = dk->desc[i].next;
+    free_desc(dk, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -196,105 +290,367 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// disk transfers and discards use three descriptors, flushes two.
 static int
-alloc3_desc(int *idx)
+alloc_descs(struct disk *dk, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(dk);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(dk, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// add the request at descriptor id, which has just
+// finished, to the latency histogram.
+static void
+account(struct disk *dk, int id)
+{
+  uint64 t = r_time() - dk->info[id].start;
+  int i;
+
+  for(i = 0; i < NLATBUCKET-1 && t >= 2; i++)
+    t >>= 1;
+  dk->ios.lat[(int)dk->info[id].write][dk->info[id].class][i]++;
+}
+
+// process the entries the device has added to the used ring,
+// and free their descriptors.
+// self is a request whose owner is polling for it, rather
+// than sleeping, so it needs no wakeup().
+// caller holds dk->vdisk_lock.
+static void
+drain(struct disk *dk, int *self)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  // the device increments dk->used->idx when it
+  // adds an entry to the used ring.
+
+  while(dk->used_idx != USED_IDX(dk)){
+    __sync_synchronize();
+    int id = dk->used->ring[dk->used_idx % NUM].id;
+
+    if(dk->info[id].status != 0)
+      panic("virtio_disk_intr status");
+
+    if(dk->info[id].class >= 0)
+      account(dk, id);
+    dk->inflight--;
+
+    int *done = dk->info[id].done;
+    *done = 0;   // e.g. disk is done with buf
+    if(done != self)
+      wakeup(done);
+    dk->info[id].done = 0;
+    free_chain(dk, id);
+
+    dk->used_idx += 1;
+  }
+}
+
+// ask the device not to interrupt for completions
+// until the next rearm().
+static void
+suppress(struct disk *dk)
+{
+  if(dk->st.event_idx)
+    dk->avail->used_event = dk->used_idx + 0x8000; // far away
+  else
+    dk->avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+  __sync_synchronize();
+}
+
+// ask the device to interrupt for the next completion.
+// returns 1 if the used ring already holds new entries,
+// which the device may not interrupt for.
+static int
+rearm(struct disk *dk)
+{
+  if(dk->st.event_idx)
+    dk->avail->used_event = dk->used_idx;
+  else
+    dk->avail->flags = 0;
+  __sync_synchronize();
+  return dk->used_idx != USED_IDX(dk);
+}
+
+// spin on the used ring for a little while, with interrupts
+// suppressed, hoping the request finishes before it's worth
+// paying for an interrupt and a sleep()/wakeup().
+// caller holds dk->vdisk_lock.
+static void
+poll(struct disk *dk, int *done)
+{
+  uint64 deadline = r_time() + POLLTICKS;
+
+  suppress(dk);
+  while(*done && r_time() < deadline){
+    if(dk->used_idx != USED_IDX(dk))
+      drain(dk, done);
+  }
+  while(rearm(dk))
+    drain(dk, done);
 
-  acquire(&disk.vdisk_lock);
+  if(*done == 0)
+    dk->st.npollhit++;
+  else
+    dk->st.npollmiss++;
+}
+
+// hand the chain starting at descriptor head to the device.
+// caller holds dk->vdisk_lock.
+static void
+submit(struct disk *dk, int head)
+{
+  dk->ios.qdepth[dk->inflight < NQDEPTH ? dk->inflight : NQDEPTH-1]++;
+  dk->inflight++;
+  dk->info[head].start = r_time();
+
+  // tell the device the first index in our chain of descriptors.
+  dk->avail->ring[dk->avail->idx % NUM] = head;
+
+  __sync_synchronize();
 
+  // tell the device another avail ring entry is available.
+  uint16 old = dk->avail->idx;
+  dk->avail->idx += 1; // not % NUM ...
+  dk->st.nreq++;
+
+  __sync_synchronize();
+
+  // with EVENT_IDX the device says, through avail_event, whether
+  // it wants to hear about the new entry; it may still be busy
+  // with earlier ones, and will find this one on its own.
+  if(!dk->st.event_idx ||
+     vring_need_event(dk->used->avail_event, dk->avail->idx, old)){
+    *R(dk, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+    dk->st.nnotify++;
+  }
+}
+
+// queue a request of the given type for len bytes of data at
+// sector, and arrange for *done to be cleared when it finishes.
+// data is 0 for a flush. class is the IO_ class for iostat,
+// or -1 if the request isn't a transfer.
+// caller holds dk->vdisk_lock.
+static void
+request(struct disk *dk, int type, int class, uint64 sector, void *data, int len, int *done)
+{
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // data, one for a 1-byte status result. a flush has no data.
+  int n = data ? 3 : 2;
 
-  // allocate the three descriptors.
+  // allocate the descriptors.
   int idx[3];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(dk, idx, n) == 0) {
       break;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    sleep(&dk->free[0], &dk->vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &dk->ops[idx[0]];
 
-  if(write)
-    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->type = type;
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  dk->desc[idx[0]].addr = (uint64) buf0;
+  dk->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  dk->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  dk->desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  if(data){
+    dk->desc[idx[1]].addr = (uint64) data;
+    dk->desc[idx[1]].len = len;
+    if(type == VIRTIO_BLK_T_IN)
+      dk->desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes data
+    else
+      dk->desc[idx[1]].flags = 0; // device reads data
+    dk->desc[idx[1]].flags |= VRING_DESC_F_NEXT;
+    dk->desc[idx[1]].next = idx[2];
+  }
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  dk->info[idx[0]].status = 0xff; // device writes 0 on success
+  dk->desc[idx[n-1]].addr = (uint64) &dk->info[idx[0]].status;
+  dk->desc[idx[n-1]].len = 1;
+  dk->desc[idx[n-1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  dk->desc[idx[n-1]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the completion flag for virtio_disk_intr().
+  *done = 1;
+  dk->info[idx[0]].done = done;
+  dk->info[idx[0]].write = type == VIRTIO_BLK_T_OUT;
+  dk->info[idx[0]].class = class;
 
-  // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  submit(dk, idx[0]);
+}
 
-  __sync_synchronize();
+// wait for a submitted request to clear *done.
+// caller holds dk->vdisk_lock.
+static void
+waitdone(struct disk *dk, int *done)
+{
+  if(dk->st.mode == DISK_MODE_POLL && *done)
+    poll(dk, done);
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  // Wait for virtio_disk_intr() to say request has finished.
+  while(*done) {
+    sleep(done, &dk->vdisk_lock);
+  }
+}
 
-  __sync_synchronize();
+// read block 0 of dk, where a disklabel would be. there is no
+// process to sleep yet, so spin until the request finishes.
+static void
+readlabel(struct disk *dk, struct disklabel *label)
+{
+  static char data[BSIZE];
+  int busy;
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  acquire(&dk->vdisk_lock);
+  request(dk, VIRTIO_BLK_T_IN, IO_META, 0, data, BSIZE, &busy);
+  while(busy)
+    drain(dk, &busy);
+  release(&dk->vdisk_lock);
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  memmove(label, data, sizeof(*label));
+}
+
+// start reading or writing b->data at blockno, without waiting
+// for it to finish. the caller must keep b locked until
+// virtio_disk_wait().
+static void
+virtio_disk_start(int unit, struct buf *b, uint blockno, int write)
+{
+  struct disk *dk = &disk[unit];
+  uint64 sector = (uint64)blockno * (BSIZE / 512);
+
+  acquire(&dk->vdisk_lock);
+  request(dk, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, b->class,
+          sector, b->data, BSIZE, &b->disk);
+  release(&dk->vdisk_lock);
+}
+
+// wait for the request started by virtio_disk_start(b).
+static void
+virtio_disk_wait(int unit, struct buf *b, uint blockno)
+{
+  struct disk *dk = &disk[unit];
+
+  acquire(&dk->vdisk_lock);
+  waitdone(dk, &b->disk);
+  release(&dk->vdisk_lock);
+}
+
+// write n blocks from data to blockno.. as one request, and
+// wait for it. data must not be on the stack, since the
+// device reads it by DMA.
+static void
+virtio_disk_writen(int unit, uint blockno, void *data, uint n, int class)
+{
+  struct disk *dk = &disk[unit];
+  int busy;
+
+  acquire(&dk->vdisk_lock);
+  request(dk, VIRTIO_BLK_T_OUT, class, (uint64)blockno * (BSIZE / 512),
+          data, n * BSIZE, &busy);
+  waitdone(dk, &busy);
+  release(&dk->vdisk_lock);
+}
+
+// ask the device to write back its volatile write cache, making
+// every write that has already finished durable. together with
+// waiting for those writes, this is an ordering barrier.
+// a no-op if the device didn't offer VIRTIO_BLK_F_FLUSH, which
+// means it has no such cache.
+static void
+virtio_disk_flush(int unit)
+{
+  struct disk *dk = &disk[unit];
+  int busy;
+
+  if(!dk->st.flush)
+    return;
+
+  acquire(&dk->vdisk_lock);
+  dk->st.nflush++;
+  request(dk, VIRTIO_BLK_T_FLUSH, -1, 0, 0, 0, &busy);
+  waitdone(dk, &busy);
+  release(&dk->vdisk_lock);
+}
+
+// tell the device that blocks blockno..blockno+nblocks-1 are
+// no longer in use, so that the host can release their storage.
+// a no-op if the device didn't offer VIRTIO_BLK_F_DISCARD.
+static void
+virtio_disk_discard(int unit, uint blockno, uint nblocks)
+{
+  struct disk *dk = &disk[unit];
+  int busy;
+  uint n;
+
+  if(!dk->st.discard)
+    return;
+
+  acquire(&dk->vdisk_lock);
+
+  // the device reads dseg by DMA, so it can't live on the
+  // stack; one discard at a time.
+  while(dk->discarding)
+    sleep(&dk->discarding, &dk->vdisk_lock);
+  dk->discarding = 1;
+
+  for(; nblocks > 0; blockno += n, nblocks -= n){
+    n = nblocks < dk->maxdiscard ? nblocks : dk->maxdiscard;
+    dk->dseg.sector = (uint64)blockno * (BSIZE / 512);
+    dk->dseg.num_sectors = n * (BSIZE / 512);
+    dk->dseg.flags = 0;
+    dk->st.ndiscard++;
+    request(dk, VIRTIO_BLK_T_DISCARD, -1, 0, &dk->dseg, sizeof(dk->dseg), &busy);
+    waitdone(dk, &busy);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  dk->discarding = 0;
+  wakeup(&dk->discarding);
+  release(&dk->vdisk_lock);
+}
 
-  release(&disk.vdisk_lock);
+static uint
+virtio_disk_size(int unit)
+{
+  return disk[unit].capacity / (BSIZE / 512);
 }
 
+static struct bdevsw virtio_bdevsw = {
+  .start = virtio_disk_start,
+  .wait = virtio_disk_wait,
+  .writen = virtio_disk_writen,
+  .flush = virtio_disk_flush,
+  .discard = virtio_disk_discard,
+  .size = virtio_disk_size,
+};
+
 void
-virtio_disk_intr()
+virtio_disk_intr(int irq)
 {
-  acquire(&disk.vdisk_lock);
+  struct disk *dk;
+
+  for(dk = disk; dk < &disk[ndisk]; dk++)
+    if(dk->irq == irq)
+      break;
+  if(dk == &disk[ndisk])
+    return;
+
+  acquire(&dk->vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
@@ -302,26 +658,86 @@ virtio_disk_intr()
   // the "used" ring, in which case we may process the new
   // completion entries in this interrupt, and have nothing to do
   // in the next interrupt, which is harmless.
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  *R(dk, VIRTIO_MMIO_INTERRUPT_ACK) = *R(dk, VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  dk->st.nintr++;
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+  // with EVENT_IDX, the device doesn't interrupt for entries it
+  // adds while we're draining, so keep going until rearm() says
+  // the ring stayed empty.
+  do {
+    drain(dk, 0);
+  } while(rearm(dk));
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
+  release(&dk->vdisk_lock);
+}
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+// report the counters of all the disks, summed, in *st,
+// and switch them to mode if it is DISK_MODE_INTR or
+// DISK_MODE_POLL. returns the previous mode.
+int
+virtio_disk_stat(int mode, struct diskstat *st)
+{
+  int old = DISK_MODE_INTR;
+
+  memset(st, 0, sizeof(*st));
+  st->ndisk = ndisk;
+  for(struct disk *dk = disk; dk < &disk[ndisk]; dk++){
+    acquire(&dk->vdisk_lock);
+    if(dk == disk){
+      old = dk->st.mode;
+      st->event_idx = dk->st.event_idx;
+      st->flush = dk->st.flush;
+      st->discard = dk->st.discard;
+    }
+    if(mode == DISK_MODE_INTR || mode == DISK_MODE_POLL)
+      dk->st.mode = mode;
+    st->mode = dk->st.mode;
+    st->nreq += dk->st.nreq;
+    st->nnotify += dk->st.nnotify;
+    st->nflush += dk->st.nflush;
+    st->ndiscard += dk->st.ndiscard;
+    st->nintr += dk->st.nintr;
+    st->npollhit += dk->st.npollhit;
+    st->npollmiss += dk->st.npollmiss;
+    release(&dk->vdisk_lock);
+  }
+  return old;
+}
 
-    disk.used_idx += 1;
+// read the iostat device: the histograms of all the disks, summed.
+static int
+iostatread(int user_dst, uint64 dst, int n)
+{
+  struct iostat ios;
+  uint64 *from, *to;
+  int i;
+
+  memset(&ios, 0, sizeof(ios));
+  for(struct disk *dk = disk; dk < &disk[ndisk]; dk++){
+    acquire(&dk->vdisk_lock);
+    from = (uint64 *)&dk->ios;
+    to = (uint64 *)&ios;
+    for(i = 0; i < sizeof(ios) / sizeof(uint64); i++)
+      to[i] += from[i];
+    release(&dk->vdisk_lock);
   }
+  if(n > sizeof(ios))
+    n = sizeof(ios);
+  if(either_copyout(user_dst, dst, &ios, n) < 0)
+    return -1;
+  return n;
+}
 
-  release(&disk.vdisk_lock);
+// any write to the iostat device resets the histograms.
+static int
+iostatwrite(int user_src, uint64 src, int n)
+{
+  for(struct disk *dk = disk; dk < &disk[ndisk]; dk++){
+    acquire(&dk->vdisk_lock);
+    memset(&dk->ios, 0, sizeof(dk->ios));
+    release(&dk->vdisk_lock);
+  }
+  return n;
 }
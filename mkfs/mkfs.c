@@ -15,15 +15,18 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
-
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+// with -j, the log is on a disk of its own, attached after the
+// file system's, and the file system has no log blocks.
+
+int fssize = 10000;  // size of file system in blocks (-b)
+int ninodes = 200;   // inodes in the file system (-n)
+int nbitmap;
+int ninodeblocks;
+int nlog = NLOG;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+int nfslog;   // Number of log blocks in the file system image
 int nblocks;  // Number of data blocks
 
 int fsfd;
@@ -40,6 +43,8 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint ebmap(struct dinode *din, uint fbn);
+void stripe(char *img, int ndisks, int stripesz);
 void die(const char *);
 
 // convert to riscv byte order
@@ -68,7 +73,9 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
+  int i, cc, fd, opt;
+  int ndisks = 1, stripesz = 16, extents = 1;
+  char *logimg = 0;
   uint rootino, inum, off;
   struct dirent de;
   char buf[BSIZE];
@@ -77,8 +84,48 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  while((opt = getopt(argc, argv, "b:n:d:s:j:i")) != -1){
+    switch(opt){
+    case 'b':
+      fssize = atoi(optarg);
+      break;
+    case 'n':
+      ninodes = atoi(optarg);
+      break;
+    case 'i':
+      extents = 0;
+      break;
+    case 'j':
+      logimg = optarg;
+      break;
+    case 'd':
+      ndisks = atoi(optarg);
+      break;
+    case 's':
+      stripesz = atoi(optarg);
+      break;
+    default:
+      argc = 0;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if(argc < 2 || ndisks < 1 || ndisks > NVDISK || stripesz < 1 ||
+     fssize < 1 || ninodes < 2){
+    fprintf(stderr, "Usage: mkfs [-b blocks] [-n inodes] [-d ndisks] [-s stripe] [-j log.img] [-i] fs.img files...\n");
+    exit(1);
+  }
+
+  // the kernel's per-op log budgets and inode map limit these.
+  nbitmap = fssize / BPB + 1;
+  ninodeblocks = ninodes / IPB + 1;
+  if(nbitmap > MAXBITMAP){
+    fprintf(stderr, "mkfs: at most %d blocks\n", MAXBITMAP * BPB - 1);
+    exit(1);
+  }
+  if(ninodes > MAXINODES){
+    fprintf(stderr, "mkfs: at most %d inodes\n", MAXINODES);
     exit(1);
   }
 
@@ -90,25 +137,46 @@ main(int argc, char *argv[])
     die(argv[1]);
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  nfslog = logimg ? 0 : nlog;
+  nmeta = 2 + nfslog + ninodeblocks + nbitmap;
+  nblocks = fssize - nmeta;
+  if(nblocks < 1){
+    fprintf(stderr, "mkfs: %d blocks is too small\n", fssize);
+    exit(1);
+  }
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
-  sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.logstart = xint(logimg ? 0 : 2);
+  sb.inodestart = xint(2+nfslog);
+  sb.bmapstart = xint(2+nfslog+ninodeblocks);
+  // the kernel numbers the file system's disk (or striped
+  // set) ROOTDEV, and the next disk ROOTDEV+1.
+  sb.logdev = xint(logimg ? ROOTDEV+1 : 0);
+  // -i: map files with addrs[] instead of extents.
+  sb.features = xint(extents ? FS_EXTENTS : 0);
+  sb.bsize = xint(BSIZE);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nfslog, ninodeblocks, nbitmap, nblocks, fssize);
+
+  // an all-zero log is an empty one.
+  if(logimg){
+    if((fd = open(logimg, O_RDWR|O_CREAT|O_TRUNC, 0666)) < 0 ||
+       ftruncate(fd, (off_t)nlog * BSIZE) < 0)
+      die(logimg);
+    close(fd);
+  }
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  // leave unused blocks as holes in a sparse file; the kernel
+  // discards blocks it frees, so the image stays sparse.
+  if(ftruncate(fsfd, (off_t)fssize * BSIZE) < 0)
+    die(argv[1]);
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -118,12 +186,12 @@ main(int argc, char *argv[])
   assert(rootino == ROOTINO);
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, ".");
   iappend(rootino, &de, sizeof(de));
 
   bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
+  de.inum = xint(rootino);
   strcpy(de.name, "..");
   iappend(rootino, &de, sizeof(de));
 
@@ -150,7 +218,7 @@ main(int argc, char *argv[])
     inum = ialloc(T_FILE);
 
     bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
+    de.inum = xint(inum);
     strncpy(de.name, shortname, DIRSIZ);
     iappend(rootino, &de, sizeof(de));
 
@@ -162,20 +230,25 @@ main(int argc, char *argv[])
 
   // fix size of root inode dir
   rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  if((xint(din.flags) & DI_INLINE) == 0){
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
+  }
 
   balloc(freeblock);
 
+  if(ndisks > 1)
+    stripe(argv[1], ndisks, stripesz);
+
   exit(0);
 }
 
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
+  if(lseek(fsfd, (off_t)sec * BSIZE, 0) != (off_t)sec * BSIZE)
     die("lseek");
   if(write(fsfd, buf, BSIZE) != BSIZE)
     die("write");
@@ -211,7 +284,7 @@ rinode(uint inum, struct dinode *ip)
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
+  if(lseek(fsfd, (off_t)sec * BSIZE, 0) != (off_t)sec * BSIZE)
     die("lseek");
   if(read(fsfd, buf, BSIZE) != BSIZE)
     die("read");
@@ -223,10 +296,16 @@ ialloc(ushort type)
   uint inum = freeinode++;
   struct dinode din;
 
+  if(inum >= ninodes){
+    fprintf(stderr, "mkfs: out of inodes\n");
+    exit(1);
+  }
+
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
   din.size = xint(0);
+  din.flags = xint(DI_INLINE);
   winode(inum, &din);
   return inum;
 }
@@ -262,15 +341,35 @@ iappend(uint inum, void *xp, int n)
   rinode(inum, &din);
   off = xint(din.size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
+  if(xint(din.flags) & DI_INLINE){
+    if(off + n <= NINLINE){
+      bcopy(p, din.data + off, n);
+      din.size = xint(off + n);
+      winode(inum, &din);
+      return;
+    }
+    // too big to stay in the inode: append its contents
+    // again, to blocks.
+    bcopy(din.data, buf, off);
+    bzero(din.data, sizeof(din.data));
+    din.flags = xint(xint(din.flags) & ~DI_INLINE);
+    din.size = xint(0);
+    winode(inum, &din);
+    iappend(inum, buf, off);
+    rinode(inum, &din);
+  }
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(xint(sb.features) & FS_EXTENTS){
+      x = ebmap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
     } else {
+      // the files mkfs copies in don't need doubly indirect blocks.
+      assert(fbn < NDIRECT + NINDIRECT);
       if(xint(din.addrs[NDIRECT]) == 0){
         din.addrs[NDIRECT] = xint(freeblock++);
       }
@@ -293,6 +392,87 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// Find file block fbn of extent-mapped din, which is either
+// mapped or the next block. mkfs only builds a root leaf,
+// which is plenty for the files it copies in.
+uint
+ebmap(struct dinode *din, uint fbn)
+{
+  struct extnode *h = (struct extnode*)din->addrs;
+  struct extent *e = (struct extent*)(h + 1);
+  uint start, len, b = 0;
+  int i, n = xshort(h->n);
+
+  for(i = 0; i < n; i++){
+    start = xint(e[i].start);
+    len = xint(e[i].len);
+    if(fbn < b + len)
+      return start + fbn - b;
+    b += len;
+  }
+  assert(fbn == b);
+  if(n > 0 && xint(e[n-1].start) + xint(e[n-1].len) == freeblock){
+    e[n-1].len = xint(xint(e[n-1].len) + 1);
+  } else {
+    assert(n < NIEXTENT);
+    e[n].start = xint(freeblock);
+    e[n].len = xint(1);
+    h->n = xshort(n + 1);
+  }
+  return freeblock++;
+}
+
+// Split the finished image into ndisks member images of a
+// striped set, img.0 and up, for the kernel's stripe.c: a
+// disklabel block, then the member's stripe units in order.
+// Every member gets the same number of units, padding out the
+// end of the file system with zeroes. Zero blocks are left as
+// holes, as in the image itself.
+void
+stripe(char *img, int ndisks, int stripesz)
+{
+  char name[256], buf[BSIZE];
+  struct disklabel label;
+  uint units, b, unit, mb;
+  int m, mfd;
+
+  units = (fssize + stripesz*ndisks - 1) / (stripesz*ndisks);
+  for(m = 0; m < ndisks; m++){
+    snprintf(name, sizeof(name), "%s.%d", img, m);
+    mfd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    if(mfd < 0)
+      die(name);
+
+    memset(buf, 0, sizeof(buf));
+    label.magic = xint(LABELMAGIC);
+    label.ndisks = xint(ndisks);
+    label.index = xint(m);
+    label.stripe = xint(stripesz);
+    memmove(buf, &label, sizeof(label));
+    if(write(mfd, buf, BSIZE) != BSIZE)
+      die(name);
+
+    for(mb = 0; mb < units*stripesz; mb++){
+      unit = (mb / stripesz) * ndisks + m;
+      b = unit * stripesz + mb % stripesz;
+      if(b < fssize)
+        rsect(b, buf);
+      else
+        memset(buf, 0, sizeof(buf));
+      if(memcmp(buf, zeroes, BSIZE) == 0){
+        if(lseek(mfd, BSIZE, SEEK_CUR) < 0)
+          die(name);
+      } else if(write(mfd, buf, BSIZE) != BSIZE)
+        die(name);
+    }
+    if(ftruncate(mfd, (off_t)(1 + units*stripesz) * BSIZE) < 0)
+      die(name);
+    close(mfd);
+  }
+  printf("stripe: %d disks, %d blocks per unit, %u units each\n",
+         ndisks, stripesz, units);
+}
+
 void
 die(const char *s)
 {
@@ -0,0 +1,132 @@
+// crash-safety test of the log in delayed mode, run by
+// grade-crash. "crashtest write" fsync()s and fdatasync()s
+// two files, then rewrites others until qemu is killed.
+// after a reboot, "crashtest check" checks that the synced
+// files survived and that recovery left the rest whole.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/logmode.h"
+#include "user/user.h"
+
+#define NSYNC   20  // blocks in each synced file
+#define NFILE   26  // files rewritten until the crash
+#define MAXBLK  12  // most blocks in one of them
+
+char buf[BSIZE];
+
+void
+fail(char *msg, char *name)
+{
+  printf("crashtest: %s %s\n", msg, name);
+  exit(1);
+}
+
+// create name with n blocks of c, and maybe sync it.
+void
+put(char *name, int c, int n, int (*sync)(int))
+{
+  int fd, i;
+
+  unlink(name);
+  if((fd = open(name, O_CREATE|O_WRONLY)) < 0)
+    fail("cannot create", name);
+  memset(buf, c, BSIZE);
+  for(i = 0; i < n; i++)
+    if(write(fd, buf, BSIZE) != BSIZE)
+      fail("cannot write", name);
+  if(sync && sync(fd) < 0)
+    fail("cannot sync", name);
+  close(fd);
+}
+
+// check that name holds only c, in whole blocks, and
+// return how many, or -1 if it doesn't exist.
+int
+get(char *name, int c)
+{
+  int fd, i, n, nblk;
+
+  if((fd = open(name, O_RDONLY)) < 0)
+    return -1;
+  nblk = 0;
+  while((n = read(fd, buf, BSIZE)) > 0){
+    if(n != BSIZE)
+      fail("partial block in", name);
+    for(i = 0; i < BSIZE; i++)
+      if(buf[i] != c)
+        fail("wrong contents in", name);
+    nblk++;
+  }
+  close(fd);
+  return nblk;
+}
+
+void
+writer(void)
+{
+  char name[4];
+  int i;
+
+  if(logmode(LOG_DELAYED) < 0)
+    fail("cannot switch to", "delayed mode");
+  put("ctsync", 's', NSYNC, fsync);
+  put("ctdsync", 'd', NSYNC, fdatasync);
+  printf("crashtest: synced\n");
+
+  name[0] = 'c';
+  name[1] = 't';
+  name[3] = 0;
+  for(i = 1; ; i++){
+    name[2] = 'a' + i % NFILE;
+    put(name, name[2], 1 + i % MAXBLK, 0);
+    if(i % 100 == 0)
+      printf("crashtest: %d files\n", i);
+  }
+}
+
+void
+checker(void)
+{
+  char name[4];
+  int i, n;
+
+  if(get("ctsync", 's') != NSYNC)
+    fail("lost fsync()ed", "ctsync");
+  if(get("ctdsync", 'd') != NSYNC)
+    fail("lost fdatasync()ed", "ctdsync");
+
+  name[0] = 'c';
+  name[1] = 't';
+  name[3] = 0;
+  for(i = 0; i < NFILE; i++){
+    name[2] = 'a' + i;
+    if((n = get(name, name[2])) > MAXBLK)
+      fail("too big", name);
+    unlink(name);
+  }
+
+  // the file system must still work.
+  put("ctsync", 'x', MAXBLK, fsync);
+  if(get("ctsync", 'x') != MAXBLK)
+    fail("cannot rewrite", "ctsync");
+  unlink("ctsync");
+  unlink("ctdsync");
+  printf("crashtest: ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc == 2 && strcmp(argv[1], "write") == 0)
+    writer();
+  else if(argc == 2 && strcmp(argv[1], "check") == 0)
+    checker();
+  else {
+    fprintf(2, "usage: crashtest write|check\n");
+    exit(1);
+  }
+  exit(0);
+}
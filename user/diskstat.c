@@ -0,0 +1,42 @@
+// print disk driver counters, and optionally
+// switch its completion mode.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/diskstat.h"
+#include "user/user.h"
+
+int
+main(int argc, char **argv)
+{
+  int mode = -1;
+  struct diskstat st;
+
+  if(argc > 2)
+    goto usage;
+  if(argc == 2){
+    if(strcmp(argv[1], "intr") == 0)
+      mode = DISK_MODE_INTR;
+    else if(strcmp(argv[1], "poll") == 0)
+      mode = DISK_MODE_POLL;
+    else
+      goto usage;
+  }
+
+  if(diskstat(mode, &st) < 0){
+    fprintf(2, "diskstat: failed\n");
+    exit(1);
+  }
+
+  printf("%d disks, mode %s, event_idx %d, flush %d, discard %d\n",
+         st.ndisk, st.mode == DISK_MODE_POLL ? "poll" : "intr",
+         st.event_idx, st.flush, st.discard);
+  printf("requests %l notifies %l interrupts %l flushes %l discards %l\n",
+         st.nreq, st.nnotify, st.nintr, st.nflush, st.ndiscard);
+  printf("poll hits %l misses %l\n", st.npollhit, st.npollmiss);
+  exit(0);
+
+usage:
+  fprintf(2, "usage: diskstat [intr|poll]\n");
+  exit(1);
+}
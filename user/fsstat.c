@@ -0,0 +1,45 @@
+// print the block allocator's and name cache's counters, and how many
+// runs of contiguous blocks each named file is in.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/fsstat.h"
+#include "user/user.h"
+
+int
+main(int argc, char **argv)
+{
+  struct fsstat st;
+  struct stat s;
+  int i, fd;
+
+  if(fsstat(-1, &st) < 0){
+    fprintf(2, "fsstat: failed\n");
+    exit(1);
+  }
+  printf("%d blocks, %d free, %d groups\n", st.nblocks, st.nfree, st.ngroup);
+  printf("allocations %l blocks %l at goal %l bitmap scans %l\n",
+         st.nalloc, st.nblock, st.ngoal, st.nscan);
+  if(st.nalloc > 0)
+    printf("ticks per allocation %l\n", st.ticks / st.nalloc);
+  printf("name cache hits %l negative hits %l misses %l\n",
+         st.ndchit, st.ndcneg, st.ndcmiss);
+
+  for(i = 1; i < argc; i++){
+    if((fd = open(argv[i], O_RDONLY)) < 0){
+      fprintf(2, "fsstat: cannot open %s\n", argv[i]);
+      continue;
+    }
+    if(fstat(fd, &s) < 0 || fsstat(fd, &st) < 0){
+      fprintf(2, "fsstat: cannot stat %s\n", argv[i]);
+      close(fd);
+      continue;
+    }
+    printf("%s: %l blocks in %d runs\n", argv[i],
+           (s.size + BSIZE - 1) / BSIZE, st.nrun);
+    close(fd);
+  }
+  exit(0);
+}
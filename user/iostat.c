@@ -0,0 +1,83 @@
+// print disk latency histograms and queue depths from the
+// iostat device, or reset them with -r.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "kernel/fcntl.h"
+#include "kernel/iostat.h"
+#include "user/user.h"
+
+char *classname[NIOCLASS] = {
+[IO_META] "meta",
+[IO_DATA] "data",
+[IO_LOG]  "log",
+};
+
+// print one histogram, skipping empty buckets. bucket i holds
+// latencies from 2^i time ticks; qemu's timebase is 10 MHz,
+// so a tick is 100 ns.
+void
+printlat(char *what, char *class, uint64 *lat)
+{
+  uint64 n = 0;
+  int i;
+
+  for(i = 0; i < NLATBUCKET; i++)
+    n += lat[i];
+  if(n == 0)
+    return;
+  printf("%s %s: %l requests\n", what, class, n);
+  for(i = 0; i < NLATBUCKET; i++){
+    if(lat[i] == 0)
+      continue;
+    printf("  %s%l ns: %l\n", i == NLATBUCKET-1 ? ">=" : "", (1L << i) * 100, lat[i]);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  struct iostat ios;
+  int fd, i, rw;
+
+  if(argc > 2 || (argc == 2 && strcmp(argv[1], "-r") != 0)){
+    fprintf(2, "usage: iostat [-r]\n");
+    exit(1);
+  }
+
+  if((fd = open("/iostat", O_RDWR)) < 0){
+    mknod("/iostat", IOSTAT, 0);
+    fd = open("/iostat", O_RDWR);
+  }
+  if(fd < 0){
+    fprintf(2, "iostat: cannot open iostat\n");
+    exit(1);
+  }
+
+  if(argc == 2){
+    if(write(fd, "", 1) != 1){
+      fprintf(2, "iostat: reset failed\n");
+      exit(1);
+    }
+    exit(0);
+  }
+
+  if(read(fd, &ios, sizeof(ios)) != sizeof(ios)){
+    fprintf(2, "iostat: read failed\n");
+    exit(1);
+  }
+  for(rw = 0; rw < 2; rw++)
+    for(i = 0; i < NIOCLASS; i++)
+      printlat(rw ? "write" : "read", classname[i], ios.lat[rw][i]);
+  printf("queue depth at submit:\n");
+  for(i = 0; i < NQDEPTH; i++){
+    if(ios.qdepth[i])
+      printf("  %s%d: %l\n", i == NQDEPTH-1 ? ">=" : "", i, ios.qdepth[i]);
+  }
+  close(fd);
+  exit(0);
+}
@@ -0,0 +1,34 @@
+// print the log's commit mode, and optionally
+// switch it.
+
+#include "kernel/types.h"
+#include "kernel/logmode.h"
+#include "user/user.h"
+
+int
+main(int argc, char **argv)
+{
+  int mode = -1, old;
+
+  if(argc > 2)
+    goto usage;
+  if(argc == 2){
+    if(strcmp(argv[1], "sync") == 0)
+      mode = LOG_SYNC;
+    else if(strcmp(argv[1], "delayed") == 0)
+      mode = LOG_DELAYED;
+    else
+      goto usage;
+  }
+
+  if((old = logmode(mode)) < 0){
+    fprintf(2, "logmode: failed\n");
+    exit(1);
+  }
+  printf("%s\n", old == LOG_DELAYED ? "delayed" : "sync");
+  exit(0);
+
+usage:
+  fprintf(2, "usage: logmode [sync|delayed]\n");
+  exit(1);
+}
@@ -1,4 +1,6 @@
 struct stat;
+struct diskstat;
+struct fsstat;
 
 // system calls
 int fork(void);
@@ -22,6 +24,12 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int diskstat(int, struct diskstat*);
+int fsync(int);
+int fdatasync(int);
+int logmode(int);
+int fsstat(int, struct fsstat*);
+int fallocate(int, uint);
 
 // ulib.c
 int stat(const char*, struct stat*);
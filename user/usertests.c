@@ -7,6 +7,9 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/diskstat.h"
+#include "kernel/logmode.h"
+#include "kernel/fsstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -575,9 +578,11 @@ writetest(char *s)
   }
 }
 
+// a file that needs a doubly indirect block.
 void
 writebig(char *s)
 {
+  enum { NBIG = NDIRECT + NINDIRECT + 2*NINDIRECT };
   int i, fd, n;
 
   fd = open("big", O_CREATE|O_RDWR);
@@ -586,7 +591,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < NBIG; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -606,7 +611,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != NBIG){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -1396,10 +1401,7 @@ concreate(char *s)
   char file[3];
   int i, pid, n, fd;
   char fa[N];
-  struct {
-    ushort inum;
-    char name[DIRSIZ];
-  } de;
+  struct dirent de;
 
   file[0] = 'C';
   file[2] = '\0';
@@ -1824,6 +1826,497 @@ fourteen(char *s)
   unlink("12345678901234");
 }
 
+// do file system writes with the disk driver polling for
+// completions, and check that the polling path was taken.
+void
+diskpoll(char *s)
+{
+  struct diskstat st0, st1;
+  int fd, i, old;
+
+  old = diskstat(DISK_MODE_POLL, &st0);
+  if(old < 0){
+    printf("%s: diskstat failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 10; i++){
+    fd = open("diskpoll", O_CREATE|O_WRONLY);
+    if(fd < 0){
+      diskstat(old, 0);
+      printf("%s: create diskpoll failed\n", s);
+      exit(1);
+    }
+    if(write(fd, buf, BSIZE) != BSIZE){
+      diskstat(old, 0);
+      printf("%s: write diskpoll failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    unlink("diskpoll");
+  }
+  if(diskstat(old, &st1) != DISK_MODE_POLL){
+    printf("%s: disk mode changed under us\n", s);
+    exit(1);
+  }
+  if(st1.nreq == st0.nreq){
+    printf("%s: no disk requests while polling\n", s);
+    exit(1);
+  }
+  if(st1.npollhit + st1.npollmiss == st0.npollhit + st0.npollmiss){
+    printf("%s: requests did not poll\n", s);
+    exit(1);
+  }
+}
+
+// freed blocks should be discarded, and still be
+// usable once they're allocated again.
+void
+discard(char *s)
+{
+  struct diskstat st0, st1;
+  int fd, i, j;
+
+  if(diskstat(-1, &st0) < 0){
+    printf("%s: diskstat failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2; i++){
+    fd = open("discard", O_CREATE|O_WRONLY);
+    if(fd < 0){
+      printf("%s: create discard failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < 8; j++){
+      memset(buf, 'a' + i + j, BSIZE);
+      if(write(fd, buf, BSIZE) != BSIZE){
+        printf("%s: write discard failed\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+    if(i == 1)
+      break;
+    unlink("discard");
+  }
+
+  fd = open("discard", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open discard failed\n", s);
+    exit(1);
+  }
+  for(j = 0; j < 8; j++){
+    if(read(fd, buf, BSIZE) != BSIZE){
+      printf("%s: read discard failed\n", s);
+      exit(1);
+    }
+    if(buf[0] != 'a' + 1 + j || buf[BSIZE-1] != 'a' + 1 + j){
+      printf("%s: wrong data after discard\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("discard");
+
+  diskstat(-1, &st1);
+  if(st0.discard && st1.ndiscard == st0.ndiscard){
+    printf("%s: freed blocks were not discarded\n", s);
+    exit(1);
+  }
+}
+
+// in delayed mode, updates should be visible at once, and
+// fsync()/fdatasync() should commit them.
+void
+fsynctest(char *s)
+{
+  int fd, i, old, fds[2];
+
+  old = logmode(LOG_DELAYED);
+  if(old < 0){
+    printf("%s: logmode failed\n", s);
+    exit(1);
+  }
+  fd = open("fsync", O_CREATE|O_RDWR);
+  if(fd < 0){
+    logmode(old);
+    printf("%s: create fsync failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 4; i++){
+    memset(buf, 'a' + i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      logmode(old);
+      printf("%s: write fsync failed\n", s);
+      exit(1);
+    }
+    if((i % 2 ? fdatasync(fd) : fsync(fd)) != 0){
+      logmode(old);
+      printf("%s: fsync failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(logmode(old) != LOG_DELAYED){
+    printf("%s: log mode changed under us\n", s);
+    exit(1);
+  }
+
+  fd = open("fsync", O_RDONLY);
+  for(i = 0; i < 4; i++){
+    if(read(fd, buf, BSIZE) != BSIZE || buf[0] != 'a' + i){
+      printf("%s: wrong data after fsync\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("fsync");
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[0]) != -1 || fsync(-1) != -1){
+    printf("%s: fsync of a pipe or bad fd succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// two files written a block at a time, turn about, so that
+// neither gets contiguous blocks and each needs more extents
+// than fit in its inode.
+void
+interleave(char *s)
+{
+  enum { N = 200 };
+  int fd[2], i, j;
+
+  for(j = 0; j < 2; j++){
+    fd[j] = open(j ? "interleave1" : "interleave0", O_CREATE|O_RDWR);
+    if(fd[j] < 0){
+      printf("%s: create interleave failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    for(j = 0; j < 2; j++){
+      memset(buf, 0, BSIZE);
+      ((int*)buf)[0] = i;
+      ((int*)buf)[1] = j;
+      if(write(fd[j], buf, BSIZE) != BSIZE){
+        printf("%s: write interleave failed\n", s);
+        exit(1);
+      }
+    }
+  }
+  for(j = 0; j < 2; j++){
+    close(fd[j]);
+    fd[j] = open(j ? "interleave1" : "interleave0", O_RDONLY);
+    for(i = 0; i < N; i++){
+      if(read(fd[j], buf, BSIZE) != BSIZE ||
+         ((int*)buf)[0] != i || ((int*)buf)[1] != j){
+        printf("%s: read interleave%d block %d wrong\n", s, j, i);
+        exit(1);
+      }
+    }
+    close(fd[j]);
+  }
+  unlink("interleave0");
+  unlink("interleave1");
+}
+
+// blocks reserved by fallocate() stay contiguous even with
+// another file growing alongside, and those not written are
+// given back at close.
+void
+fallocatetest(char *s)
+{
+  enum { N = 64 };
+  int fd, fd1, i;
+  uint nfree;
+  struct fsstat st;
+
+  fd = open("falloc", O_CREATE|O_RDWR);
+  fd1 = open("falloc1", O_CREATE|O_RDWR);
+  if(fd < 0 || fd1 < 0){
+    printf("%s: create falloc failed\n", s);
+    exit(1);
+  }
+  if(fallocate(fd, N*BSIZE) != 0){
+    printf("%s: fallocate failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N/2; i++){
+    memset(buf, i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE || write(fd1, buf, BSIZE) != BSIZE){
+      printf("%s: write falloc failed\n", s);
+      exit(1);
+    }
+  }
+  // two runs if an indirect block comes between.
+  if(fsstat(fd, &st) != 0 || st.nrun > 2){
+    printf("%s: falloc in %d pieces\n", s, st.nrun);
+    exit(1);
+  }
+  nfree = st.nfree;
+  close(fd);
+  close(fd1);
+  fsstat(-1, &st);
+  if(st.nfree != nfree + N/2){
+    printf("%s: close gave back %d blocks, not %d\n", s, st.nfree - nfree, N/2);
+    exit(1);
+  }
+
+  fd = open("falloc", O_RDONLY);
+  for(i = 0; i < N/2; i++){
+    if(read(fd, buf, BSIZE) != BSIZE || buf[0] != i || buf[BSIZE-1] != i){
+      printf("%s: read falloc wrong\n", s);
+      exit(1);
+    }
+  }
+  if(read(fd, buf, 1) != 0){
+    printf("%s: falloc too long\n", s);
+    exit(1);
+  }
+  if(fallocate(fd, 2*N*BSIZE) != -1){
+    printf("%s: fallocate of read-only fd succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("falloc");
+  unlink("falloc1");
+}
+
+// ialloc() gives files made in a directory inodes in the
+// directory's inode block while it has free ones, including
+// ones just freed there, rather than wherever it last left off.
+void
+inodenear(char *s)
+{
+  int i, k, fd;
+  char name[8];
+  struct stat st;
+  uint b;
+
+  if(mkdir("inear") != 0 || stat("inear", &st) < 0){
+    printf("%s: mkdir inear failed\n", s);
+    exit(1);
+  }
+  b = st.ino / IPB;
+  strcpy(name, "inear/?");
+
+  // more files than the block can hold: those in it come
+  // first.
+  k = 0;
+  for(i = 0; i < IPB; i++){
+    name[6] = '0' + i;
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0 || fstat(fd, &st) < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    if(st.ino / IPB == b){
+      if(k != i){
+        printf("%s: %s in inear's inode block after one that wasn't\n",
+               s, name);
+        exit(1);
+      }
+      k++;
+    }
+  }
+  for(i = 0; i < IPB; i++){
+    name[6] = '0' + i;
+    unlink(name);
+  }
+
+  // the k inodes freed in the block are the ones to reuse.
+  for(i = 0; i < k; i++){
+    name[6] = '0' + i;
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0 || fstat(fd, &st) < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    if(st.ino / IPB != b){
+      printf("%s: %s got inode %d, not one in inear's block %d\n",
+             s, name, st.ino, b);
+      exit(1);
+    }
+  }
+  for(i = 0; i < k; i++){
+    name[6] = '0' + i;
+    unlink(name);
+  }
+  if(unlink("inear") != 0){
+    printf("%s: unlink inear failed\n", s);
+    exit(1);
+  }
+}
+
+// a directory big enough to be indexed still reads as a list
+// of dirents, and can be emptied and removed.
+void
+dirindex(char *s)
+{
+  enum { N = 3 * BSIZE / sizeof(struct dirent) / 2 };
+  int i, fd, n;
+  char name[10];
+  struct dirent de;
+
+  if(mkdir("dx") != 0 || (fd = open("dx/f", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create dx failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  name[0] = 'd';
+  name[1] = 'x';
+  name[2] = '/';
+  name[5] = '\0';
+  for(i = 0; i < N; i++){
+    name[3] = '0' + (i / 64);
+    name[4] = '0' + (i % 64);
+    if(link("dx/f", name) != 0){
+      printf("%s: link(dx/f, %s) failed\n", s, name);
+      exit(1);
+    }
+  }
+
+  fd = open("dx", O_RDONLY);
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de))
+    if(de.inum != 0)
+      n++;
+  close(fd);
+  // ".", "..", f and the links.
+  if(n != N + 3){
+    printf("%s: read %d entries from dx, not %d\n", s, n, N + 3);
+    exit(1);
+  }
+
+  for(i = 0; i < N; i++){
+    name[3] = '0' + (i / 64);
+    name[4] = '0' + (i % 64);
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("dx") == 0){
+    printf("%s: unlink non-empty dx succeeded\n", s);
+    exit(1);
+  }
+  if(unlink("dx/f") != 0 || unlink("dx") != 0){
+    printf("%s: unlink dx failed\n", s);
+    exit(1);
+  }
+}
+
+// a small file is kept in its inode, and keeps what it held
+// when it grows too big for that.
+void
+inlinefile(char *s)
+{
+  enum { N = 50 };
+  int fd, i;
+  struct fsstat st;
+
+  for(i = 0; i < N + BSIZE; i++)
+    buf[i] = 'a' + i % 26;
+  fd = open("inl", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, N) != N){
+    printf("%s: write inl failed\n", s);
+    exit(1);
+  }
+  if(fsstat(fd, &st) != 0 || st.nrun != 0){
+    printf("%s: small file has blocks\n", s);
+    exit(1);
+  }
+  if(write(fd, buf + N, BSIZE) != BSIZE){
+    printf("%s: write inl failed\n", s);
+    exit(1);
+  }
+  if(fsstat(fd, &st) != 0 || st.nrun != 1){
+    printf("%s: inl in %d runs\n", s, st.nrun);
+    exit(1);
+  }
+  close(fd);
+
+  memset(buf, 0, N + BSIZE);
+  fd = open("inl", O_RDONLY);
+  if(fd < 0 || read(fd, buf, N + BSIZE + 1) != N + BSIZE){
+    printf("%s: read inl failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < N + BSIZE; i++){
+    if(buf[i] != 'a' + i % 26){
+      printf("%s: inl byte %d is %x\n", s, i, buf[i]);
+      exit(1);
+    }
+  }
+
+  fd = open("inl", O_TRUNC|O_RDWR);
+  if(fd < 0 || write(fd, buf, N) != N ||
+     fsstat(fd, &st) != 0 || st.nrun != 0){
+    printf("%s: truncated inl has blocks\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("inl");
+}
+
+// names the kernel has remembered being absent, or present,
+// must not stay that way after they're created or removed,
+// even in a new directory that reuses a removed one's inode.
+void
+namecache(char *s)
+{
+  int i, fd;
+
+  for(i = 0; i < 2; i++){
+    if(open("nc", O_RDONLY) >= 0){
+      printf("%s: open nc before create succeeded\n", s);
+      exit(1);
+    }
+  }
+  if((fd = open("nc", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create nc failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("nc", O_RDONLY)) < 0){
+    printf("%s: open nc after create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("nc");
+  if(open("nc", O_RDONLY) >= 0){
+    printf("%s: open nc after unlink succeeded\n", s);
+    exit(1);
+  }
+
+  for(i = 0; i < 2; i++){
+    if(mkdir("ncd") != 0){
+      printf("%s: mkdir ncd failed\n", s);
+      exit(1);
+    }
+    if(open("ncd/f", O_RDONLY) >= 0){
+      printf("%s: open ncd/f in new ncd succeeded\n", s);
+      exit(1);
+    }
+    if((fd = open("ncd/f", O_CREATE|O_RDWR)) < 0){
+      printf("%s: create ncd/f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("ncd/f") != 0 || unlink("ncd") != 0){
+      printf("%s: unlink ncd failed\n", s);
+      exit(1);
+    }
+  }
+}
+
 void
 rmdot(char *s)
 {
@@ -2615,6 +3108,15 @@ struct test {
   {bigfile, "bigfile"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
+  {diskpoll, "diskpoll"},
+  {discard, "discard"},
+  {fsynctest, "fsynctest"},
+  {interleave, "interleave"},
+  {fallocatetest, "fallocatetest"},
+  {inodenear, "inodenear"},
+  {dirindex, "dirindex"},
+  {namecache, "namecache"},
+  {inlinefile, "inlinefile"},
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
@@ -2837,7 +3339,6 @@ diskfull(char *s)
       break;
     }
     for(int i = 0; i < MAXFILE; i++){
-      char buf[BSIZE];
       if(write(fd, buf, BSIZE) != BSIZE){
         done = 1;
         close(fd);
@@ -2924,11 +3425,175 @@ outofinodes(char *s)
   }
 }
 
+// write and read back a file of several megabytes, reporting
+// the throughput, and how many pieces the file is in.
+void
+hugefile(char *s)
+{
+  enum { NB = 4096, CHUNK = 16 };
+  int fd, i, j, t0, t1, t2;
+  struct fsstat st;
+
+  unlink("huge");
+  fd = open("huge", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create huge failed\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  for(i = 0; i < NB; i += CHUNK){
+    for(j = 0; j < CHUNK; j++)
+      ((int*)(buf + j*BSIZE))[0] = i + j;
+    if(write(fd, buf, CHUNK*BSIZE) != CHUNK*BSIZE){
+      printf("%s: write huge failed at block %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(fsstat(fd, &st) < 0){
+    printf("%s: fsstat failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  t1 = uptime();
+  fd = open("huge", O_RDONLY);
+  for(i = 0; i < NB; i += CHUNK){
+    if(read(fd, buf, CHUNK*BSIZE) != CHUNK*BSIZE){
+      printf("%s: read huge failed at block %d\n", s, i);
+      exit(1);
+    }
+    for(j = 0; j < CHUNK; j++){
+      if(((int*)(buf + j*BSIZE))[0] != i + j){
+        printf("%s: block %d of huge is wrong\n", s, i + j);
+        exit(1);
+      }
+    }
+  }
+  if(read(fd, buf, 1) != 0){
+    printf("%s: huge too long\n", s);
+    exit(1);
+  }
+  close(fd);
+  t2 = uptime();
+  unlink("huge");
+
+  // ticks are about 1/10 second.
+  printf("%s: %d KB in %d runs, written in %d ticks, read in %d ticks\n",
+         s, NB*BSIZE/1024, st.nrun, t1 - t0, t2 - t1);
+}
+
+// fill the file system with one-block files, in directories
+// of NF, until it runs out of inodes or blocks (or the test
+// runs out of names), then look each up again and remove them,
+// reporting what it cost. make FSBLOCKS=n FSINODES=m makes a
+// file system big enough to show how balloc(), ialloc(), and
+// dirlookup() scale.
+void
+fillfs(char *s)
+{
+  enum { ND = 64, NF = 512 };
+  int fd, d, f, n, t0, t1, t2, t3;
+  char name[8];
+  struct fsstat st0, st1, st2;
+
+  if(mkdir("fillfs") < 0 || chdir("fillfs") < 0){
+    printf("%s: mkdir fillfs failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'f', BSIZE);
+  fsstat(-1, &st0);
+
+  t0 = uptime();
+  n = 0;
+  for(d = 0; d < ND && n == d*NF; d++){
+    name[0] = 'd';
+    name[1] = '0' + d / 8;
+    name[2] = '0' + d % 8;
+    name[3] = '\0';
+    if(mkdir(name) < 0)
+      break;
+    name[3] = '/';
+    name[7] = '\0';
+    for(f = 0; f < NF; f++){
+      name[4] = '0' + f / 64;
+      name[5] = '0' + f / 8 % 8;
+      name[6] = '0' + f % 8;
+      if((fd = open(name, O_CREATE|O_WRONLY)) < 0)
+        break;
+      if(write(fd, buf, BSIZE) != BSIZE){
+        close(fd);
+        unlink(name);
+        break;
+      }
+      close(fd);
+      n++;
+    }
+  }
+  if(n == 0){
+    printf("%s: no files created\n", s);
+    exit(1);
+  }
+  fsstat(-1, &st1);
+
+  // "dNN/fff": the fill loop may have stopped at a mkdir().
+  name[0] = 'd';
+  name[3] = '/';
+  name[7] = '\0';
+  t1 = uptime();
+  for(f = 0; f < n; f++){
+    name[1] = '0' + f / NF / 8;
+    name[2] = '0' + f / NF % 8;
+    name[4] = '0' + f % NF / 64;
+    name[5] = '0' + f % NF / 8 % 8;
+    name[6] = '0' + f % NF % 8;
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+  fsstat(-1, &st2);
+
+  t2 = uptime();
+  for(f = 0; f < n; f++){
+    name[1] = '0' + f / NF / 8;
+    name[2] = '0' + f / NF % 8;
+    name[4] = '0' + f % NF / 64;
+    name[5] = '0' + f % NF / 8 % 8;
+    name[6] = '0' + f % NF % 8;
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  name[3] = '\0';
+  for(f = 0; f < d; f++){
+    name[1] = '0' + f / 8;
+    name[2] = '0' + f % 8;
+    unlink(name);
+  }
+  t3 = uptime();
+  chdir("/");
+  unlink("fillfs");
+
+  // ticks are about 1/10 second; the allocator's are time CSR
+  // ticks.
+  printf("%s: %d files in %d dirs: created in %d ticks, looked up in %d, "
+         "removed in %d\n", s, n, d, t1 - t0, t2 - t1, t3 - t2);
+  printf("%s: %l allocations, %l bitmap scans, %l ticks each\n", s,
+         st1.nalloc - st0.nalloc, st1.nscan - st0.nscan,
+         (st1.ticks - st0.ticks) / (st1.nalloc - st0.nalloc));
+  printf("%s: lookups: %l name cache hits, %l directory searches\n", s,
+         st2.ndchit - st1.ndchit, st2.ndcmiss - st1.ndcmiss);
+}
+
 struct test slowtests[] = {
   {bigdir, "bigdir"},
   {manywrites, "manywrites"},
   {badwrite, "badwrite" },
   {execout, "execout"},
+  {hugefile, "hugefile"},
+  {fillfs, "fillfs"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
     
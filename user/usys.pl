@@ -36,3 +36,9 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("diskstat");
+entry("fsync");
+entry("fdatasync");
+entry("logmode");
+entry("fsstat");
+entry("fallocate");